@@ -10,32 +10,29 @@
 #include "scope.h"
 
 
-// maybe a bit small? can always change later if needed
-typedef uint8_t ssa_ref;
+typedef uint32_t ssa_ref;
 typedef uint8_t ssa_kind;
-typedef uint32_t ssa_extension;
+typedef uint64_t ssa_extension;
 
 #define REF_NONE ((ssa_ref)-1)
 
 enum ssa_opcode
 {
 	SSA_NONE = 0,
-	SSA_IMM, // 1 extension // little endian
+	SSA_IMM, // 1 extension (.v = value)
 	SSA_ADD, SSA_SUB,
-	SSA_CALL, // to = call ext.0 [R args] // +1 ext/4 args
+	SSA_CALL, // to = call ext.0 [R args] // the args are packed as ssa_ref[] in the following extensions
 	SSA_GLOBAL_REF, // `ins.to = ref(ext.v)`
 	SSA_COPY,
 #define COMBINE_TYPE(T, U) ((T)+(U)*TYPE_PRIMITIVE_END)
 	SSA_CONVERT,
 	SSA_RET,
 	SSA_BOOL, // the value is embedded in the L field
-	SSA_LABEL,
+	SSA_LABEL, // in 2AC, L is the alignment wanted for the label, 0 when any will do
 	// TODO: make BRcc/SETcc separate instructions for each cc
 	SSA_SET, // set(cc) dst, lhs, rhs // 1 ext (.to = cc)
 	SSA_BOOL_NEG,
-	// SSA_PHI, // to = phi [L:ext.L] [R:ext.R]
-	// if ever arises the need to traverse the cfg,
-	// change the goto/br format slightly to make that possible
+	SSA_PHI, // to = phi [R labels] [R values] // packed as ssa_ref[] in the extensions, like the call args
 	SSA_GOTO,
 	SSA_BR, // br(cc) lhs, rhs, then, else // 1 extension (.L=then, .R=else)
 	SSA_ARG,
@@ -44,6 +41,8 @@ enum ssa_opcode
 	SSA_MUL,
 	SSA_MEMCOPY, // dst = memcpy(src)
 	SSA_OFFSETOF, // to = offsetof(T.L, .R)
+	SSA_LEA, // to = L + R*ext.L + (int32_t) ext.R // 1 extension, a scale of 0 means there is no index and R is unused
+	SSA_MULI, // to = L * ext.v // 1 extension
 
 	SSA_NUM
 };
@@ -54,11 +53,13 @@ enum ssa_branch_cc {
 };
 
 // 3-address
+// an extension slot has the size of a full instruction
 typedef union ssa_instr {
 	struct { ssa_kind kind; ssa_ref to, L, R; };
 	ssa_extension v;
 } ssa_instr;
-static_assert(sizeof (ssa_instr) == sizeof (ssa_extension), "");
+static_assert(sizeof (ssa_instr) == 4 * sizeof (ssa_ref), "");
+#define SSA_REFS_PER_EXT (sizeof(ssa_instr) / sizeof(ssa_ref))
 
 typedef struct ir3_node {
 	idx_t begin, end; // ssa_instr indices
@@ -83,8 +84,16 @@ typedef struct ir3_sym {
 	enum { IR3_FUNC, IR3_BLOB, IR3_AGGREG } kind;
 } ir3_sym;
 
+// number of extension slots that follow `i` in the instruction stream
+idx_t ssa_ext_len(const ssa_instr *i);
+// the locals read by `i` are [return value, *end)
+ssa_ref *ssa_uses(ssa_instr *i, ssa_ref **end);
+// the local written by `i`, or REF_NONE
+ssa_ref ssa_def(const ssa_instr *i);
+
 typedef scratch_arr ir3_module;
-ir3_module convert_to_3ac(module_t ast, scope *enclosing, allocator *a);
+// the function bodies are lowered on `jobs` threads (one per core if <= 0), `a` has to be thread-safe then
+ir3_module convert_to_3ac(module_t ast, scope *enclosing, int jobs, allocator *a);
 ir3_module convert_to_2ac(ir3_module m3ac, allocator *a);
 
 void bytecode_init(allocator *temps);
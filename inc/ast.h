@@ -7,6 +7,8 @@
 #include "token.h"
 #include "map.h"
 
+#include <stdatomic.h>
+
 
 // TODO: make AST more compact
 
@@ -166,8 +168,10 @@ typedef scratch_arr module_t; // array of decl_idx
 extern struct ast_state_t
 {
 	allocator *temps;
-	size_t errors;
+	atomic_size_t errors; // counted from every thread
 	dyn_arr decls; // array of decl*
+	allocation arenas; // allocator_geom[], where the declarations parsed on each thread live
+	int num_arenas;
 } ast;
 
 int ast_init(allocator *up);
@@ -175,7 +179,9 @@ void ast_fini(allocator *up);
 void ast_one_more_error(void);
 int ast_dump(module_t ast);
 
-module_t parse_module(allocator *up);
+// the top-level declarations are parsed on `jobs` threads (one per core if <= 0),
+// the module and the diagnostics come out in the order of the source
+module_t parse_module(int jobs, allocator *up);
 decl *idx2decl(decl_idx i);
 
 expr *expr_convert(allocator *a, expr *e, type *to);
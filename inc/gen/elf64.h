@@ -6,6 +6,9 @@
 
 
 int elf_object_from(const gen_module *mod, const char *path, const dyn_arr *names, allocator *a);
+// links the module on its own into a static executable, started by a stub that calls `entry`
+// and exits with what it returns; no rt.o nor ld needed. -1 and errno on failure, EINVAL without `entry`
+int elf_executable_from(const gen_module *mod, const char *path, const dyn_arr *names, allocator *a);
 
 #endif /* NYAN_GEN_ELF64_H */
 
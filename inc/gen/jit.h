@@ -0,0 +1,21 @@
+#ifndef NYAN_GEN_JIT_H
+#define NYAN_GEN_JIT_H
+
+
+#include "gen/x86-64.h"
+
+
+// the module laid out in the memory of the process, the way the linker would have put it in the executable:
+// .rodata then .text, each on its own pages, the relocations resolved
+typedef struct jit_image {
+	allocation m; // the whole mapping, mmap'd
+	allocation addrs; // void *[number of syms], the address of each gen_sym
+} jit_image;
+
+// -1 with errno set when the pages can't be mapped or protected
+int jit_load(jit_image *img, const gen_module *mod, allocator *a);
+// the address of the symbol called `name`, NULL if there is none
+void *jit_lookup(const jit_image *img, const dyn_arr *names, const char *name);
+void jit_fini(jit_image *img, allocator *a);
+
+#endif /* NYAN_GEN_JIT_H */
@@ -17,7 +17,7 @@ typedef struct gen_sym {
 		struct { idx_t index, size; };
 		struct {
 			scratch_arr ins; // bytes
-			scratch_arr refs; // array of gen_reloc lo=offset in symbol, hi=referenced index
+			scratch_arr refs; // array of gen_reloc lo=offset in symbol, hi=referenced index, only to .rodata after gen_x86_64
 		};
 	};
 	enum { GEN_CODE, GEN_RODATA } kind;
@@ -29,10 +29,12 @@ typedef struct gen_module {
 	scratch_arr renum;
 	scratch_arr layouts; // [type.%i] = { { offset, size } *tinfo; alloc_size }
 	idx_t code_size;
-	idx_t num_refs;
+	idx_t num_refs; // the ones left for the linker, to .rodata
 } gen_module;
 
-gen_module gen_x86_64(ir3_module m2ac, allocator *a);
+// the function bodies are encoded on `jobs` threads (one per core if <= 0), `a` has to be thread-safe then;
+// the result doesn't depend on it
+gen_module gen_x86_64(ir3_module m2ac, int jobs, allocator *a);
 void gen_fini(gen_module *mod, allocator *a);
 
 #endif /* NYAN_GEN_X86_64_H */
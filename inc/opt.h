@@ -0,0 +1,34 @@
+#ifndef NYAN_OPT_H
+#define NYAN_OPT_H
+
+#include "3ac.h"
+#include "alloc.h"
+
+
+// splices the bodies of the small functions, and of the ones called from a single place,
+// into their callers; works on the 3AC before the conversion to SSA, so that the other passes see through
+void opt_inline(ir3_module m, allocator *a);
+
+// the passes take a function in SSA form, and leave it in SSA form
+
+// sparse conditional constant propagation: folds the constants, resolves the branches
+// and drops the blocks that can't be reached anymore
+void opt_sccp(ir3_func *f, allocator *a);
+
+// global value numbering: a pure computation already available in a dominating block
+// is replaced by the local that holds it, and so are the copies, the dead definitions are left to dce
+void opt_gvn(ir3_func *f, allocator *a);
+
+// multiplications by a constant become `muli`, and sums of a base, an index scaled by 1/2/4/8
+// and a 32-bit constant become a single `lea`, the way the x86 addressing modes see them
+void opt_addressing(ir3_func *f, allocator *a);
+
+// removes the instructions whose results are never read and that have no side effect,
+// the definitions of memory-resident locals overwritten before being read,
+// then renumbers the locals that are left so that the frame only has room for those
+void opt_dce(ir3_func *f, allocator *a);
+
+// runs every pass on the functions of the module
+void optimize(ir3_module m, allocator *a);
+
+#endif /* NYAN_OPT_H */
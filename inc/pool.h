@@ -0,0 +1,19 @@
+#ifndef NYAN_POOL_H
+#define NYAN_POOL_H
+
+#include <stddef.h>
+
+
+// number of threads used when asked for `jobs` <= 0: one per online core
+int pool_jobs(void);
+
+// the number of threads parallel_for(n, jobs, ...) runs on
+int parallel_jobs(size_t n, int jobs);
+
+// calls fn(ctx, i, worker) once for every i in [0, n), on up to `jobs` threads including the calling one;
+// `worker` in [0, parallel_jobs(n, jobs)) is the thread running it, to pick the per-thread resources with;
+// the items are handed out in an unspecified order, so fn writes its result in a slot of its own
+// and the caller reads them back in order once this returns
+void parallel_for(size_t n, int jobs, void (*fn)(void *ctx, size_t i, int worker), void *ctx);
+
+#endif /* NYAN_POOL_H */
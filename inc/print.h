@@ -20,7 +20,12 @@ bool expect_or(bool condition, ...);
 #define print(to,...) _print_impl((to), \
 		((MSK(__VA_ARGS__))<<ARGS_SHIFT)|NUM_ARGS(_, ## __VA_ARGS__), \
 		## __VA_ARGS__)
-#define expect_or(cond, ...) ((cond) ? true: (print(stderr, ## __VA_ARGS__, "\n"), ast_one_more_error(), false)) // STUPID PRECEDENCE RULES LOL
+#define expect_or(cond, ...) ((cond) ? true: (print(diag_stream(), ## __VA_ARGS__, "\n"), ast_one_more_error(), false)) // STUPID PRECEDENCE RULES LOL
+
+// where the diagnostics of the current thread go, stderr unless redirected
+FILE *diag_stream(void);
+// returns the previous one, NULL is stderr
+FILE *diag_redirect(FILE *to);
 
 typedef struct print_int { ptrdiff_t v; } print_int;
 typedef struct print_hex { ptrdiff_t v; } print_hex;
@@ -0,0 +1,38 @@
+#ifndef NYAN_SSA_H
+#define NYAN_SSA_H
+
+#include <stdbool.h>
+
+#include "3ac.h"
+#include "alloc.h"
+
+
+// the nodes of an `ir3_func` are its basic blocks, and a label is the index of a node
+// a block ends at its first terminator (goto, br, ret), or falls through to the next one
+typedef struct ir3_cfg {
+	allocation m;
+	idx_t num_blocks;
+	idx_t num_reachable;
+	idx_t *ends; // [b] = byte offset past the terminator of b, anything after it is dead
+	ssa_ref (*succ)[2]; // REF_NONE when there is none
+	idx_t *pred_begin; // the predecessors of b are preds[pred_begin[b]..pred_begin[b+1]]
+	ssa_ref *preds; // only the reachable ones, sorted
+	ssa_ref *rpo; // reverse postorder of the reachable blocks, starting with the entry
+	idx_t *order; // [b] = index of b in rpo, -1 when unreachable
+	ssa_ref *idom; // the entry is its own idom, REF_NONE when unreachable
+	idx_t *child_begin; // the dominator tree, same layout as the predecessors
+	ssa_ref *children; // in reverse postorder
+} ir3_cfg;
+
+void cfg_init(ir3_cfg *cfg, const ir3_func *f, allocator *a);
+void cfg_fini(ir3_cfg *cfg, allocator *a);
+bool cfg_dominates(const ir3_cfg *cfg, ssa_ref dom, ssa_ref b);
+bool ssa_is_terminator(const ssa_instr *i);
+
+// both work in place, on every function of the module
+// variables that have their address taken or don't fit a register are left alone
+void convert_to_ssa(ir3_module m, allocator *a);
+// phis become copies at the end of their predecessors, splitting the edges out of a `br`
+void convert_from_ssa(ir3_module m, allocator *a);
+
+#endif /* NYAN_SSA_H */
@@ -4,6 +4,8 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+#include <threads.h>
 
 #include "map.h"
 #include "alloc.h"
@@ -63,21 +65,32 @@ typedef struct token {
 	KW(return)	\
 
 
-// a compiler is called on 1 file. globals are fine
-extern struct global_token_state {
+// where each thread is in the source, the declarations can be parsed on several at once
+extern _Thread_local struct token_cursor {
 	token current;
 	token lookahead;
+	source_idx limit; // TOKEN_END from there on
+} lexer;
+
+// a compiler is called on 1 file. globals are fine
+extern struct global_token_state {
 	const char *cpath;
 	const char *base;
 	source_idx len;
-	map idents;
+	// shared by the lexers of every thread, without a lock: open addressing in a table that never grows,
+	// sized for the most names the source can hold, and the names appended to a single block
+	struct intern_table {
+		allocation slots; // _Atomic uint32_t, 1 + the offset of the name in `arena`, 0 while free
+		allocation arena;
+		atomic_size_t used;
+	} idents;
 	allocator *up; // allows the token_* functions not to take an allocator parameter just for line_marks and idents
 	allocator *names;
-	dyn_arr line_marks; // array of source_idx
+	dyn_arr line_marks; // array of source_idx, the start of every line. only diagnostics need it, built by the first find_line
+	once_flag line_marks_once;
 	#define KW(kw) ident_t kw_##kw;
 	FORALL_KEYWORDS
 	#undef KW
-	const char *keywords_begin, *keywords_end;
 } tokens;
 
 int token_init(const char *path, allocator *up, allocator *names);
@@ -85,6 +98,8 @@ void token_fini(void);
 
 bool token_done(void);
 void token_advance(void);
+// the tokens of this thread are then the ones in [begin, end)
+void token_seek(source_idx begin, source_idx end);
 
 bool token_is(token_kind k);
 bool token_match(token_kind k);
@@ -9,7 +9,8 @@
 
 typedef enum value_category { RVALUE, LVALUE } value_category;
 
-void type_check(module_t module, scope *top, allocator *up);
+// the function bodies are checked on `jobs` threads (one per core if <= 0), the diagnostics come out in order
+void type_check(module_t module, scope *top, int jobs, allocator *up);
 
 void type_init(allocator *temps);
 void type_fini(void);
@@ -7,39 +7,46 @@
 #include "token.h"
 #include "print.h"
 #include "attrs.h"
+#include "ssa.h"
+#include "opt.h"
 // TODO: remove
 #include "gen/x86-64.h"
 #include "gen/elf64.h"
+#include "gen/jit.h"
+#include "pool.h"
 
 #include <string.h>
 #include <assert.h>
 #include <stdbool.h>
 
+// the SSA_GLOBAL_REF whose extension is at offset_in in the function, to one of its initializer lists
 typedef struct ir3_reloc {
-	idx_t sym_in, offset_in;
-	decl *ref;
+	idx_t offset_in;
 } ir3_reloc;
 
+// what lowering a function produces besides its body; nothing in there is shared with another function,
+// so they can be lowered at the same time and merged in order by patch_relocs afterwards
+typedef struct ir3_ctx {
+	dyn_arr blobs; // ir3_sym, numbered from 0 until they get appended to the module
+	dyn_arr relocs; // ir3_reloc
+} ir3_ctx;
+
 static struct global_bytecode_state_t {
 	dyn_arr blob;
 	dyn_arr names;
-	dyn_arr relocs;
 	allocator *temps;
-	idx_t cur_idx;
 } bytecode;
 
 void bytecode_init(allocator *temps)
 {
 	dyn_arr_init(&bytecode.blob, 0, temps);
 	dyn_arr_init(&bytecode.names, 0, temps);
-	dyn_arr_init(&bytecode.relocs, 0, temps);
 	bytecode.temps = temps;
 }
 
 void bytecode_fini(void)
 {
 	dyn_arr_fini(&bytecode.names, bytecode.temps);
-	dyn_arr_fini(&bytecode.relocs, bytecode.temps);
 }
 
 typedef struct map_stack {
@@ -50,10 +57,90 @@ typedef struct map_stack {
 static ssa_ref new_local(dyn_arr *locals, type *t)
 {
 	ssa_ref num = dyn_arr_size(locals)/sizeof t;
+	assert(num != REF_NONE);
 	dyn_arr_push(locals, &t, sizeof t, bytecode.temps);
 	return num;
 }
 
+idx_t ssa_ext_len(const ssa_instr *i)
+{
+	switch (i->kind) {
+	case SSA_IMM:
+	case SSA_SET:
+	case SSA_GLOBAL_REF:
+	case SSA_BR:
+	case SSA_LEA:
+	case SSA_MULI:
+		return 1;
+	case SSA_CALL:
+		return (i->R + SSA_REFS_PER_EXT - 1) / SSA_REFS_PER_EXT + 1;
+	case SSA_PHI:
+		return (2 * i->R + SSA_REFS_PER_EXT - 1) / SSA_REFS_PER_EXT;
+	default:
+		return 0;
+	}
+}
+
+// `to`, `L` and `R` are contiguous, and so are the call arguments
+// which makes it possible to describe the operands with a range
+ssa_ref *ssa_uses(ssa_instr *i, ssa_ref **end)
+{
+	ssa_ref *begin = &i->L;
+	switch (i->kind) {
+	case SSA_ADD: case SSA_SUB: case SSA_MUL:
+	case SSA_SET:
+	case SSA_BR:
+		*end = &i->R + 1;
+		break;
+	case SSA_LEA:
+		*end = i[1].L? &i->R + 1: &i->L + 1;
+		break;
+	case SSA_COPY:
+	case SSA_CONVERT:
+	case SSA_BOOL_NEG:
+	case SSA_ADDRESS:
+	case SSA_LOAD:
+	case SSA_MEMCOPY:
+	case SSA_MULI:
+		*end = &i->L + 1;
+		break;
+	case SSA_RET:
+		begin = &i->to;
+		*end = &i->to + 1;
+		break;
+	case SSA_STORE: // .to -> .L
+		begin = &i->to;
+		*end = &i->L + 1;
+		break;
+	case SSA_CALL:
+		begin = (ssa_ref*) &i[2];
+		*end = begin + i->R;
+		break;
+	case SSA_PHI: // the values, not the labels
+		begin = (ssa_ref*) &i[1] + i->R;
+		*end = begin + i->R;
+		break;
+	default:
+		*end = begin;
+		break;
+	}
+	return begin;
+}
+
+ssa_ref ssa_def(const ssa_instr *i)
+{
+	switch (i->kind) {
+	case SSA_RET:
+	case SSA_LABEL:
+	case SSA_GOTO:
+	case SSA_BR:
+	case SSA_STORE:
+		return REF_NONE;
+	default:
+		return i->to;
+	}
+}
+
 static void serialize_initlist(byte *blob, expr *e, map_stack *stk)
 {
 	switch (e->kind) {
@@ -109,19 +196,25 @@ static map_entry global_name(ident_t name, size_t len, allocator *a)
 	return r;
 }
 
+static enum ssa_branch_cc cmp_cc(token_kind op)
+{
+	return	op == TOKEN_EQ ? SSAB_EQ: op == TOKEN_NEQ? SSAB_NE:
+		op == '<'      ? SSAB_LT: op == TOKEN_LEQ? SSAB_LE:
+		op == '>'      ? SSAB_GT: op == TOKEN_GEQ? SSAB_GE:
+		(assert(0), -1);
+}
+
 // rvalue is used in assignment contexts
 // a[1] = b; ---> rvalue = b
 // 12 ---> rvalue = REF_NONE
-static idx_t ir3_expr(ir3_func *f, expr *e, map_stack *stk, ssa_ref rvalue, allocator *a)
+static idx_t ir3_expr(ir3_func *f, ir3_ctx *cx, expr *e, map_stack *stk, ssa_ref rvalue, allocator *a)
 {
 	switch (e->kind) {
 		ssa_ref number;
 case EXPR_INT:
 	number = new_local(&f->locals, e->type);
-	assert(e->value <= (ssa_extension)-1);
 	dyn_arr_push(&f->ins, &(ssa_instr){ .kind=SSA_IMM, number }, sizeof(ssa_instr), a);
-	// just little endian things
-	dyn_arr_push(&f->ins, &e->value, sizeof(ssa_extension), a);
+	dyn_arr_push(&f->ins, &(ssa_instr){ .v=e->value }, sizeof(ssa_instr), a);
 	return number;
 
 case EXPR_BOOL:
@@ -130,57 +223,46 @@ case EXPR_BOOL:
 	return number;
 	
 case EXPR_NAME:
+	if (rvalue != REF_NONE)
+		dyn_arr_push(&f->ins, &(ssa_instr){ .kind=SSA_COPY, e->decl->id, rvalue }, sizeof(ssa_instr), a);
 	return e->decl->id;
 
 case EXPR_CALL:
 	{
 	assert(e->call.operand->type->kind == TYPE_FUNC);
 	idx_t num_args = scratch_len(e->call.args) / sizeof(expr*);
-	assert(num_args < (1L << (8*sizeof(ssa_ref))) - 1);
-	idx_t ratio = sizeof(ssa_extension) / sizeof(ssa_ref);
-	idx_t num_ext = (num_args + ratio - 1) / ratio + 1;
-	allocation m = ALLOC(a, (1 + num_ext) * sizeof(ssa_instr), alignof(ssa_instr));
+	assert((ssa_ref) num_args < REF_NONE);
+	idx_t num_ext = (num_args + SSA_REFS_PER_EXT - 1) / SSA_REFS_PER_EXT + 1;
+	idx_t len = (1 + num_ext) * sizeof(ssa_instr);
+	allocation m = ALLOC(a, len, alignof(ssa_instr));
+	memset(m.addr, 0, len);
 	ssa_instr *instr = m.addr;
-	*instr++ = (ssa_instr){ .kind=SSA_CALL, REF_NONE, .R=num_args };
+	instr[0] = (ssa_instr){ .kind=SSA_CALL, REF_NONE, .R=num_args };
 #ifndef NDEBUG
-	(*instr++).v = -1;
-#else
-	instr++;
+	instr[1].v = -1;
 #endif
 	// since the operand is a function designator, there is nothing to compute
 	// so it's ok to call and then evaluate it
-	ident_t func = ir3_expr(f, e->call.operand, stk, REF_NONE, a);
-	// little endian things
-	ssa_ref buf[ratio];
+	ident_t func = ir3_expr(f, cx, e->call.operand, stk, REF_NONE, a);
+	ssa_ref *args = (ssa_ref*) &instr[2];
 	expr **base = scratch_start(e->call.args);
-	idx_t arg, idx;
-	for (arg = 0, idx = 0; arg < num_args - ratio; arg++, idx %= ratio) {
-		// ??? // FIXME: not giving the right id, either here or in decode
-		buf[idx++] = ir3_expr(f, base[arg], stk, REF_NONE, a);
-		if ((arg + ratio - 1) % ratio == 0)
-			memcpy(instr++, buf, sizeof buf);
-	}
-	// last iteration is special: must publish even if you have less arguments
-	for (; arg < num_args; arg++)
-		buf[idx++] = ir3_expr(f, base[arg], stk, REF_NONE, a);
-	if (num_args)
-		memcpy(instr++, buf, sizeof buf);
+	for (idx_t arg = 0; arg < num_args; arg++)
+		args[arg] = ir3_expr(f, cx, base[arg], stk, REF_NONE, a);
 	// post after the arguments are evaluated
 	number = new_local(&f->locals, e->type);
-	ssa_instr *call = dyn_arr_push(&f->ins, m.addr, (void*) instr - m.addr, a);
+	ssa_instr *call = dyn_arr_push(&f->ins, m.addr, len, a);
 	call->to = number;
-	if (func == (idx_t) -1)
-		dyn_arr_push(&bytecode.relocs, &(ir3_reloc){ .sym_in=bytecode.cur_idx, .offset_in=(void*) &call[1] - f->ins.buf.addr, .ref=e->call.operand->decl }, sizeof(ir3_reloc), a);
-	else
-		call[1].v = func;
+	// every top-level decl is numbered before any body is lowered
+	assert(func != (idx_t) -1);
+	call[1].v = func;
 	DEALLOC(a, m);
 	return number;
 	}
 
 case EXPR_ADD:
 	{
-	ssa_ref L = ir3_expr(f, e->binary.L, stk, REF_NONE, a);
-	ssa_ref R = ir3_expr(f, e->binary.R, stk, REF_NONE, a);
+	ssa_ref L = ir3_expr(f, cx, e->binary.L, stk, REF_NONE, a);
+	ssa_ref R = ir3_expr(f, cx, e->binary.R, stk, REF_NONE, a);
 	number = new_local(&f->locals, e->type);
 	token_kind op = e->binary.op;
 	enum ssa_opcode opc = 	op == '+' ? SSA_ADD:
@@ -192,17 +274,11 @@ case EXPR_ADD:
 
 case EXPR_CMP:
 	{
-	ssa_ref L = ir3_expr(f, e->binary.L, stk, REF_NONE, a);
-	ssa_ref R = ir3_expr(f, e->binary.R, stk, REF_NONE, a);
+	ssa_ref L = ir3_expr(f, cx, e->binary.L, stk, REF_NONE, a);
+	ssa_ref R = ir3_expr(f, cx, e->binary.R, stk, REF_NONE, a);
 	number = new_local(&f->locals, e->type);
-	token_kind op = e->binary.op;
-	enum ssa_branch_cc cc =	op == TOKEN_EQ ? SSAB_EQ: op == TOKEN_NEQ? SSAB_NE:
-				op == '<'      ? SSAB_LT: op == TOKEN_LEQ? SSAB_LE:
-				op == '>'      ? SSAB_GT: op == TOKEN_GEQ? SSAB_GE:
-				(assert(0), -1);
-	// wanted to work around adding this redundant SET instruction,
-	// but adding a jump in here while converting to a CFG will
-	// probably just give me bugs.
+	enum ssa_branch_cc cc = cmp_cc(e->binary.op);
+	// only for comparisons used as values, the branches compare directly (see ir3_cond)
 	dyn_arr_push(&f->ins, &(ssa_instr){ .kind=SSA_SET, number, L, R }, sizeof(ssa_instr), a);
 	dyn_arr_push(&f->ins, &(ssa_instr){ .to=cc }, sizeof(ssa_instr), a);
 	return number;
@@ -210,7 +286,7 @@ case EXPR_CMP:
 
 case EXPR_LOG_NOT:
 	{
-	ssa_ref inner = ir3_expr(f, e->unary.operand, stk, REF_NONE, a);
+	ssa_ref inner = ir3_expr(f, cx, e->unary.operand, stk, REF_NONE, a);
 	number = new_local(&f->locals, e->type);
 	dyn_arr_push(&f->ins, &(ssa_instr){ .kind=SSA_BOOL_NEG, number, inner }, sizeof(ssa_instr), a);
 	return number;
@@ -221,7 +297,7 @@ case EXPR_ADDRESS:
 	expr *sub = e->unary.operand;
 	assert(rvalue == REF_NONE);
 	if (sub->kind == EXPR_NAME) {
-		ssa_ref name = ir3_expr(f, sub, stk, REF_NONE, a);
+		ssa_ref name = ir3_expr(f, cx, sub, stk, REF_NONE, a);
 		number = new_local(&f->locals, e->type);
 		dyn_arr_push(&f->ins, &(ssa_instr){ .kind=SSA_ADDRESS, number, name }, sizeof(ssa_instr), a);
 	} else if (sub->kind == EXPR_INDEX) {
@@ -230,30 +306,35 @@ case EXPR_ADDRESS:
 		assert(base_t->kind == TYPE_ARRAY);
 		ssa_ref base;
 		if (sub->call.operand->kind == EXPR_DEREF) {
-			base = ir3_expr(f, sub->call.operand->unary.operand, stk, REF_NONE, a);
+			base = ir3_expr(f, cx, sub->call.operand->unary.operand, stk, REF_NONE, a);
 		} else {
 			expr addr = { .kind=EXPR_ADDRESS, .unary = { .operand=sub->call.operand }, .type=e->type };
-			base = ir3_expr(f, &addr, stk, REF_NONE, a);
+			base = ir3_expr(f, cx, &addr, stk, REF_NONE, a);
 		}
-		number = new_local(&f->locals, e->type);
-
+		// every step gets its own local, `offset` may well be a variable
 		expr **fst_idx = scratch_start(sub->call.args);
-		ssa_ref offset = ir3_expr(f, *fst_idx, stk, REF_NONE, a);
+		ssa_ref offset = ir3_expr(f, cx, *fst_idx, stk, REF_NONE, a);
 		for (expr **idx = fst_idx+1, **sz = scratch_start(base_t->sizes) + sizeof *sz; idx != scratch_end(sub->call.args); idx++, sz++) {
 			assert(sz[0]->kind == EXPR_INT);
-			dyn_arr_push(&f->ins, &(ssa_instr){ .kind=SSA_IMM, number }, sizeof(ssa_instr), a);
+			ssa_ref dim = new_local(&f->locals, &type_int64);
+			dyn_arr_push(&f->ins, &(ssa_instr){ .kind=SSA_IMM, dim }, sizeof(ssa_instr), a);
 			dyn_arr_push(&f->ins, &(ssa_instr){ .v=sz[0]->value }, sizeof(ssa_instr), a);
-			dyn_arr_push(&f->ins, &(ssa_instr){ .kind=SSA_MUL, offset, offset, number }, sizeof(ssa_instr), a);
-			ssa_ref evaluated_idx = ir3_expr(f, *idx, stk, RVALUE, a);
-			dyn_arr_push(&f->ins, &(ssa_instr){ .kind=SSA_ADD, offset, offset, evaluated_idx }, sizeof(ssa_instr), a);
+			ssa_ref scaled = new_local(&f->locals, &type_int64);
+			dyn_arr_push(&f->ins, &(ssa_instr){ .kind=SSA_MUL, scaled, offset, dim }, sizeof(ssa_instr), a);
+			ssa_ref evaluated_idx = ir3_expr(f, cx, *idx, stk, REF_NONE, a);
+			offset = new_local(&f->locals, &type_int64);
+			dyn_arr_push(&f->ins, &(ssa_instr){ .kind=SSA_ADD, offset, scaled, evaluated_idx }, sizeof(ssa_instr), a);
 		}
 
-		dyn_arr_push(&f->ins, &(ssa_instr){ .kind=SSA_IMM, number }, sizeof(ssa_instr), a);
+		ssa_ref elem = new_local(&f->locals, &type_int64);
+		dyn_arr_push(&f->ins, &(ssa_instr){ .kind=SSA_IMM, elem }, sizeof(ssa_instr), a);
 		dyn_arr_push(&f->ins, &(ssa_instr){ .v=base_t->base->size }, sizeof(ssa_instr), a);
-		dyn_arr_push(&f->ins, &(ssa_instr){ .kind=SSA_MUL, number, number, offset }, sizeof(ssa_instr), a);
-		dyn_arr_push(&f->ins, &(ssa_instr){ .kind=SSA_ADD, number, number, base }, sizeof(ssa_instr), a);
+		ssa_ref bytes = new_local(&f->locals, &type_int64);
+		dyn_arr_push(&f->ins, &(ssa_instr){ .kind=SSA_MUL, bytes, elem, offset }, sizeof(ssa_instr), a);
+		number = new_local(&f->locals, e->type);
+		dyn_arr_push(&f->ins, &(ssa_instr){ .kind=SSA_ADD, number, bytes, base }, sizeof(ssa_instr), a);
 	} else if (sub->kind == EXPR_DEREF) {
-		number = ir3_expr(f, sub->unary.operand, stk, REF_NONE, a);
+		number = ir3_expr(f, cx, sub->unary.operand, stk, REF_NONE, a);
 	} else if (sub->kind == EXPR_FIELD) {
 		type *inner = sub->field.operand->type;
 		assert(inner->kind == TYPE_STRUCT);
@@ -261,19 +342,19 @@ case EXPR_ADDRESS:
 		assert(field);
 		// FIXME: no constant pointer type yet
 		expr aggr = { .kind=EXPR_ADDRESS, .unary = { .operand=sub->field.operand }, .type=&type_int64 };
-		ssa_ref addr = ir3_expr(f, &aggr, stk, REF_NONE, a);
+		ssa_ref addr = ir3_expr(f, cx, &aggr, stk, REF_NONE, a);
 		ssa_ref offs = new_local(&f->locals, &type_int64);
 		dyn_arr_push(&f->ins, &(ssa_instr){ .kind=SSA_OFFSETOF, offs, inner->id, ((decl*) field->v)->id }, sizeof(ssa_instr), a);
-		dyn_arr_push(&f->ins, &(ssa_instr){ .kind=SSA_ADD, addr, addr, offs }, sizeof(ssa_instr), a);
-		number = addr;
+		number = new_local(&f->locals, e->type);
+		dyn_arr_push(&f->ins, &(ssa_instr){ .kind=SSA_ADD, number, addr, offs }, sizeof(ssa_instr), a);
 	} else __builtin_unreachable();
 	return number;
 	}
 
 case EXPR_DEREF:
 	{
-	// if (e->unary.operand->kind == EXPR_ADDRESS) return ir3_expr(f, e->unary.operand->unary.operand, stk, REF_NONE, a);
-	ssa_ref addr = ir3_expr(f, e->unary.operand, stk, REF_NONE, a);
+	// if (e->unary.operand->kind == EXPR_ADDRESS) return ir3_expr(f, cx, e->unary.operand->unary.operand, stk, REF_NONE, a);
+	ssa_ref addr = ir3_expr(f, cx, e->unary.operand, stk, REF_NONE, a);
 	int size = e->type->size;
 	bool primitive = size == 1 || size == 2 || size == 4 || size == 8;
 	if (rvalue == REF_NONE) {
@@ -296,23 +377,19 @@ case EXPR_INDEX:
 	// kind of messy because this deref shouldnt be elided
 	// means that *&x = 1; doesnt elide
 	// TODO: maybe consider adding a NO_ELIDE_DEREF
-	return ir3_expr(f, &deref, stk, rvalue, a);
+	return ir3_expr(f, cx, &deref, stk, rvalue, a);
 	}
 
 case EXPR_INITLIST:
 	{
 	ir3_sym blob = { .m=ALLOC(a, e->type->size, 8), .align=e->type->align, .kind=IR3_BLOB };
-	idx_t ref = dyn_arr_size(&bytecode.blob) / sizeof(ir3_sym);
-	dyn_arr_push(&bytecode.blob, &blob, sizeof blob, a);
+	idx_t ref = dyn_arr_size(&cx->blobs) / sizeof(ir3_sym);
+	dyn_arr_push(&cx->blobs, &blob, sizeof blob, a);
 	serialize_initlist(blob.m.addr, e, stk);
-	char buf[16];
-	int len = snprintf(buf, sizeof buf, ".G%x", ref);
-	assert(buf[len] == '\0');
-	map_entry name = global_name((ident_t) buf, len, a);
-	dyn_arr_push(&bytecode.names, &name, sizeof name, a);
 	ssa_ref local = new_local(&f->locals, &type_int64);
 	dyn_arr_push(&f->ins, &(ssa_instr){ .kind=SSA_GLOBAL_REF, local }, sizeof(ssa_instr), a);
-	dyn_arr_push(&f->ins, &(ssa_instr){ .v=ref }, sizeof(ssa_extension), a);
+	ssa_instr *ext = dyn_arr_push(&f->ins, &(ssa_instr){ .v=ref }, sizeof(ssa_instr), a);
+	dyn_arr_push(&cx->relocs, &(ir3_reloc){ (void*) ext - f->ins.buf.addr }, sizeof(ir3_reloc), a);
 	number = new_local(&f->locals, e->type);
 	// FIXME: also take the address of target, and remove the `lea` in codegen
 	dyn_arr_push(&f->ins, &(ssa_instr){ .kind=SSA_MEMCOPY, number, local }, sizeof(ssa_instr), a);
@@ -322,7 +399,7 @@ case EXPR_INITLIST:
 case EXPR_CONVERT:
 	{
 	assert(rvalue == REF_NONE);
-	ssa_ref from = ir3_expr(f, e->convert.operand, stk, rvalue, a);
+	ssa_ref from = ir3_expr(f, cx, e->convert.operand, stk, rvalue, a);
 	number = new_local(&f->locals, e->type);
 	type *from_t = from[(type**) f->locals.buf.addr];
 	assert(TYPE_PRIMITIVE_BEGIN <= e->type->kind && e->type->kind <= TYPE_PRIMITIVE_END);
@@ -336,7 +413,7 @@ case EXPR_FIELD:
 	{
 	expr addr  = { .kind=EXPR_ADDRESS, .unary = { .operand=e }, .type=&type_int64 };
 	expr deref = { .kind=EXPR_DEREF  , .unary = { .operand=&addr }, .type=e->type };
-	return ir3_expr(f, &deref, stk, rvalue, a);
+	return ir3_expr(f, cx, &deref, stk, rvalue, a);
 	}
 
 case EXPR_UNDEF:
@@ -349,15 +426,17 @@ default:
 	}
 }
 
-static void ir3_decl(ir3_func *f, decl_idx i, map_stack *stk, allocator *a)
+static void ir3_decl(ir3_func *f, ir3_ctx *cx, decl_idx i, map_stack *stk, allocator *a)
 {
 	decl *d = idx2decl(i);
 	switch (d->kind) {
 case DECL_VAR:
 	{
-	ssa_ref val = ir3_expr(f, d->init, stk, REF_NONE, a);
+	ssa_ref before = dyn_arr_size(&f->locals) / sizeof(type*);
+	ssa_ref val = ir3_expr(f, cx, d->init, stk, REF_NONE, a);
 	type *init_type = d->init->type;
-	if (d->init->kind == EXPR_NAME) {
+	// the value belongs to someone else, e.g. `x: int32 = y;` or `p: T* = &*q;`
+	if (val < before) {
 		assert(init_type->kind == d->type->kind);
 		ssa_ref number = new_local(&f->locals, d->type);
 		d->id = number;
@@ -372,31 +451,55 @@ default:
 }
 }
 
-static void ir3_stmt(ir3_func *f, stmt *s, map_stack *stk, scope **blk, allocator *a)
+// the operands and condition of the branch on `e`
+// a comparison (or its negation) is branched on as is, without a bool in between
+static enum ssa_branch_cc ir3_cond(ir3_func *f, ir3_ctx *cx, expr *e, map_stack *stk, ssa_ref *L, ssa_ref *R, allocator *a)
+{
+	static const enum ssa_branch_cc negate[SSAB_NUM] = {
+		[SSAB_EQ] = SSAB_NE, [SSAB_NE] = SSAB_EQ, [SSAB_LT] = SSAB_GE,
+		[SSAB_LE] = SSAB_GT, [SSAB_GT] = SSAB_LE, [SSAB_GE] = SSAB_LT,
+	};
+	bool negated = false;
+	for (; e->kind == EXPR_LOG_NOT; e = e->unary.operand)
+		negated = !negated;
+	enum ssa_branch_cc cc;
+	if (e->kind == EXPR_CMP) {
+		*L = ir3_expr(f, cx, e->binary.L, stk, REF_NONE, a);
+		*R = ir3_expr(f, cx, e->binary.R, stk, REF_NONE, a);
+		cc = cmp_cc(e->binary.op);
+	} else {
+		*L = ir3_expr(f, cx, e, stk, REF_NONE, a);
+		*R = new_local(&f->locals, &type_bool);
+		dyn_arr_push(&f->ins, &(ssa_instr){ .kind=SSA_BOOL, *R, 0 }, sizeof(ssa_instr), a);
+		cc = SSAB_NE;
+	}
+	return negated? negate[cc]: cc;
+}
+
+static void ir3_stmt(ir3_func *f, ir3_ctx *cx, stmt *s, map_stack *stk, scope **blk, allocator *a)
 {
 	switch (s->kind) {
 	ssa_instr buf[2];
 case STMT_DECL:
-	ir3_decl(f, s->d, stk, a);
+	ir3_decl(f, cx, s->d, stk, a);
 	break;
 case STMT_ASSIGN:
 	{
-	ssa_ref R = ir3_expr(f, s->assign.R, stk, REF_NONE, a);
-	ir3_expr(f, s->assign.L, stk, R, a);
+	ssa_ref R = ir3_expr(f, cx, s->assign.R, stk, REF_NONE, a);
+	ir3_expr(f, cx, s->assign.L, stk, R, a);
 	break;
 	}
 case STMT_RETURN:
 	{
-	ssa_ref ret = ir3_expr(f, s->e, stk, REF_NONE, a);
+	ssa_ref ret = ir3_expr(f, cx, s->e, stk, REF_NONE, a);
 	dyn_arr_push(&f->ins, &(ssa_instr){ .kind=SSA_RET, ret }, sizeof(ssa_instr), a);
 	break;
 	}
 case STMT_IFELSE:
 	{
-	ssa_ref cond = ir3_expr(f, s->ifelse.cond, stk, REF_NONE, a);
-	ssa_ref check = new_local(&f->locals, &type_bool);
-	dyn_arr_push(&f->ins, &(ssa_instr){ .kind=SSA_BOOL, check, 0 }, sizeof(ssa_instr), a);
-	buf[0] = (ssa_instr){ .kind=SSA_BR, SSAB_NE, cond, check };
+	ssa_ref L, R;
+	enum ssa_branch_cc cc = ir3_cond(f, cx, s->ifelse.cond, stk, &L, &R, a);
+	buf[0] = (ssa_instr){ .kind=SSA_BR, cc, L, R };
 	buf[1] = (ssa_instr){ .v = -1 };
 	// the then/else label fields are in the extension
 	ssa_instr *br = dyn_arr_push(&f->ins, buf, 2*sizeof *buf, a) + sizeof(ssa_instr);
@@ -405,7 +508,7 @@ case STMT_IFELSE:
 
 	ir3_node *then_n = dyn_arr_push(&f->nodes, NULL, sizeof *then_n, a);
 	then_n->begin = then_n[-1].end = dyn_arr_size(&f->ins);
-	ir3_stmt(f, s->ifelse.s_then, stk, blk, a);
+	ir3_stmt(f, cx, s->ifelse.s_then, stk, blk, a);
 	buf[0].kind = SSA_GOTO;
 	ssa_instr *then_i = dyn_arr_push(&f->ins, buf, sizeof *buf, a);
 	idx_t then_i_idx = (void*) then_i - f->ins.buf.addr;
@@ -417,7 +520,7 @@ case STMT_IFELSE:
 		br->R = dyn_arr_size(&f->nodes)/sizeof(ir3_node);
 		ir3_node *else_n = dyn_arr_push(&f->nodes, NULL, sizeof *else_n, a);
 		else_n[-1].end = else_n->begin = dyn_arr_size(&f->ins);
-		ir3_stmt(f, s->ifelse.s_else, stk, blk, a);
+		ir3_stmt(f, cx, s->ifelse.s_else, stk, blk, a);
 		else_i = dyn_arr_push(&f->ins, buf, sizeof *buf, a);
 		else_i_idx = (void*) else_i - f->ins.buf.addr;
 	}
@@ -453,8 +556,8 @@ case STMT_WHILE:
 	 * 	s;
 	 * 	goto L2
 	 * L2:
-	 * 	if (c) goto L3
-	 * 	else goto L1
+	 * 	if (c) goto L1
+	 * 	else goto L3
 	 * L3:
 	 */
 
@@ -465,7 +568,7 @@ case STMT_WHILE:
 	ssa_ref lbl_body = dyn_arr_size(&f->nodes) / sizeof(ir3_node);
 	ir3_node *body = dyn_arr_push(&f->nodes, NULL, sizeof *body, a);
 	body[-1].end = body->begin = dyn_arr_size(&f->ins);
-	ir3_stmt(f, s->ifelse.s_then, stk, blk, a);
+	ir3_stmt(f, cx, s->ifelse.s_then, stk, blk, a);
 	ssa_ref lbl_cond = dyn_arr_size(&f->nodes) / sizeof(ir3_node);
 	goto_cond = f->ins.buf.addr + cond_idx;
 	goto_cond->to = lbl_cond;
@@ -473,13 +576,12 @@ case STMT_WHILE:
 
 	ir3_node *cond_blk = dyn_arr_push(&f->nodes, NULL, sizeof *cond_blk, a);
 	cond_blk[-1].end = cond_blk->begin = dyn_arr_size(&f->ins);
-	ssa_ref cond = ir3_expr(f, s->ifelse.cond, stk, REF_NONE, a);
-	ssa_ref check = new_local(&f->locals, &type_bool);
-	dyn_arr_push(&f->ins, &(ssa_instr){ .kind=SSA_BOOL, check, 0 }, sizeof(ssa_instr), a);
+	ssa_ref L, R;
+	enum ssa_branch_cc cc = ir3_cond(f, cx, s->ifelse.cond, stk, &L, &R, a);
 	ssa_ref lbl_post = dyn_arr_size(&f->nodes) / sizeof(ir3_node);
 	ir3_node *post = dyn_arr_push(&f->nodes, NULL, sizeof *post, a);
-	buf[0] = (ssa_instr){ .kind=SSA_BR, SSAB_EQ, cond, check };
-	buf[1] = (ssa_instr){ .L=lbl_post, .R=lbl_body };
+	buf[0] = (ssa_instr){ .kind=SSA_BR, cc, L, R };
+	buf[1] = (ssa_instr){ .L=lbl_body, .R=lbl_post };
 	dyn_arr_push(&f->ins, buf, 2*sizeof *buf, a);
 	post[-1].end = post->begin = dyn_arr_size(&f->ins);
 
@@ -491,7 +593,7 @@ case STMT_BLOCK:
 	scope *sub = scratch_start(blk[0]->sub);
 	map_stack top = { .scope=(*blk)++, .next=stk };
 	for (stmt **iter = scratch_start(s->blk), **end = scratch_end(s->blk); iter != end; iter++) {
-		ir3_stmt(f, *iter, &top, &sub, a);
+		ir3_stmt(f, cx, *iter, &top, &sub, a);
 	}
 	break;
 	}
@@ -500,15 +602,17 @@ default:
 	}
 }
 
-static void ir3_decl_func(ir3_func *f, decl *d, map_stack *stk, scope** fsc, allocator *a)
+static void ir3_decl_func(ir3_func *f, ir3_ctx *cx, decl *d, map_stack *stk, scope *fsc, allocator *a)
 {
+	dyn_arr_init(&cx->blobs, 0, a);
+	dyn_arr_init(&cx->relocs, 0, a);
 	dyn_arr_init(&f->ins, 0, a);
 	dyn_arr_init(&f->nodes, 0, a);
 	ir3_node *first = dyn_arr_push(&f->nodes, NULL, sizeof *first, a);
 	first->begin = 0; // end will be set by the next time something is pushed, and one last time at the end
 	dyn_arr_init(&f->locals, 0, a);
-	scope *sub = scratch_start(fsc[0]->sub);
-	map_stack top = { .scope=(*fsc)++, .next=stk };
+	scope *sub = scratch_start(fsc->sub);
+	map_stack top = { .scope=fsc, .next=stk };
 	for (decl *start = scratch_start(d->type->params), *arg = start; arg != scratch_end(d->type->params); arg++) {
 		arg->id = arg - start;
 		new_local(&f->locals, arg->type);
@@ -517,37 +621,67 @@ static void ir3_decl_func(ir3_func *f, decl *d, map_stack *stk, scope** fsc, all
 		dyn_arr_push(&f->ins, &(ssa_instr){ .kind=SSA_ARG, arg - start, arg - start }, sizeof(ssa_instr), a);
 	}
 	for (stmt **iter = scratch_start(d->body), **end = scratch_end(d->body); iter != end; iter++) {
-		ir3_stmt(f, *iter, &top, &sub, a);
+		ir3_stmt(f, cx, *iter, &top, &sub, a);
 	}
 	ir3_node *last = f->nodes.end - sizeof *last;
 	last->end = dyn_arr_size(&f->ins);
 }
 
-static void patch_relocs(ir3_module mod)
+// appends the initializer lists of the function to the module, and makes its references to them global
+static void patch_relocs(ir3_func *f, ir3_ctx *cx, allocator *a)
 {
-	ir3_sym *base_syms = scratch_start(mod);
-	for (ir3_reloc *reloc = bytecode.relocs.buf.addr; reloc != bytecode.relocs.end; reloc++) {
-		ir3_sym *sym = &base_syms[reloc->sym_in];
-		ssa_instr *ins = sym->f.ins.buf.addr + reloc->offset_in;
-		assert(reloc->ref->id != -1);
-		ins->v = reloc->ref->id;
+	// before the blobs get pushed, `f` is in the module
+	idx_t base = dyn_arr_size(&bytecode.blob) / sizeof(ir3_sym);
+	for (ir3_reloc *reloc = cx->relocs.buf.addr; reloc != cx->relocs.end; reloc++) {
+		ssa_instr *ins = f->ins.buf.addr + reloc->offset_in;
+		ins->v += base;
 	}
+	for (ir3_sym *blob = cx->blobs.buf.addr; blob != cx->blobs.end; blob++) {
+		idx_t ref = dyn_arr_size(&bytecode.blob) / sizeof(ir3_sym);
+		dyn_arr_push(&bytecode.blob, blob, sizeof *blob, bytecode.temps);
+		char buf[16];
+		int len = snprintf(buf, sizeof buf, ".G%x", ref);
+		assert(buf[len] == '\0');
+		map_entry name = global_name((ident_t) buf, len, a);
+		dyn_arr_push(&bytecode.names, &name, sizeof name, a);
+	}
+	dyn_arr_fini(&cx->blobs, a);
+	dyn_arr_fini(&cx->relocs, a);
 }
 
-// TODO:
-// 1. convert to SSA
-// 2. convert out of SSA
+typedef struct ir3_job {
+	ir3_sym *syms;
+	decl **decls; // [index in syms], NULL for the aggregates
+	scope **scopes; // [index in syms], the one of the parameters
+	ir3_ctx *cxs; // [index in syms]
+	map_stack *bottom;
+	allocator *a;
+} ir3_job;
 
-ir3_module convert_to_3ac(module_t ast, scope *enclosing, allocator *a)
+static void ir3_lower_one(void *ctx, size_t i, MAYBE_UNUSED int worker)
+{
+	ir3_job *job = ctx;
+	if (job->decls[i])
+		ir3_decl_func(&job->syms[i].f, &job->cxs[i], job->decls[i], job->bottom, job->scopes[i], job->a);
+}
+
+ir3_module convert_to_3ac(module_t ast, scope *enclosing, int jobs, allocator *a)
 {
 	map_stack bottom = { .scope=enclosing, .next=NULL };
 	// TODO: maybe incorporate fsc in the stack
 	scope *fsc = scratch_start(enclosing->sub);
+	idx_t num_decls = scratch_len(ast) / sizeof(decl_idx);
+	allocation m = ALLOC(a, (num_decls ? num_decls : 1) * (sizeof(decl*) + sizeof(scope*) + sizeof(ir3_ctx)), alignof(ir3_ctx));
+	ir3_ctx *cxs = m.addr;
+	decl **decls = (decl**) (cxs + num_decls);
+	scope **scopes = (scope**) (decls + num_decls);
+	// every top-level decl gets its number first, so that the bodies only read the ones of the others
 	for (decl_idx *start = scratch_start(ast), *end = scratch_end(ast),
 			*iter = start; iter != end; iter++) {
 		decl *d = idx2decl(*iter);
 		assert(d->id == -1);
-		d->id = bytecode.cur_idx = dyn_arr_size(&bytecode.blob) / sizeof(ir3_sym);
+		d->id = dyn_arr_size(&bytecode.blob) / sizeof(ir3_sym);
+		decls[d->id] = NULL;
 		ir3_sym sym;
 		if (d->kind == DECL_STRUCT) {
 			sym.kind = IR3_AGGREG;
@@ -571,14 +705,118 @@ ir3_module convert_to_3ac(module_t ast, scope *enclosing, allocator *a)
 		dyn_arr_push(&bytecode.names, &global, sizeof global, a);
 		assert(d->kind == DECL_FUNC);
 		sym.kind = IR3_FUNC;
-		ptrdiff_t offset = dyn_arr_push(&bytecode.blob, NULL, sizeof sym, bytecode.temps) - bytecode.blob.buf.addr;
-		ir3_decl_func(&sym.f, d, &bottom, &fsc, a);
-		memcpy(bytecode.blob.buf.addr + offset, &sym, sizeof sym);
-		// TODO: mmap trickery to reduce the need to copy potentially large amounts of data
-	}
-	ir3_module out = scratch_from(&bytecode.blob, bytecode.temps, a);
-	patch_relocs(out);
-	return out;
+		dyn_arr_push(&bytecode.blob, &sym, sizeof sym, bytecode.temps);
+		decls[d->id] = d;
+		scopes[d->id] = fsc++;
+	}
+	ir3_job job = { bytecode.blob.buf.addr, decls, scopes, cxs, &bottom, a };
+	parallel_for(num_decls, jobs, ir3_lower_one, &job);
+	// the initializer lists come after all the decls, in the order of the functions they are in
+	for (idx_t i = 0; i < num_decls; i++)
+		if (decls[i]) {
+			ir3_func *f = &((ir3_sym*) bytecode.blob.buf.addr)[i].f;
+			patch_relocs(f, &cxs[i], a);
+		}
+	DEALLOC(a, m);
+	// TODO: mmap trickery to reduce the need to copy potentially large amounts of data
+	return scratch_from(&bytecode.blob, bytecode.temps, a);
+}
+
+typedef struct block_layout {
+	const ir3_cfg *cfg;
+	ssa_ref *loop; // [b] = header of the innermost loop around b, REF_NONE outside of any
+	ssa_ref *parent; // [h] = header of the loop around the one of h
+	ssa_ref *out;
+	bool *placed, *cold;
+	idx_t len;
+} block_layout;
+
+// the loop directly inside h that contains b, b itself when it belongs to h, REF_NONE when it is outside of h
+static ssa_ref nested_in(const block_layout *l, ssa_ref b, ssa_ref h)
+{
+	ssa_ref x = l->loop[b];
+	if (x == h) return b;
+	while (x != REF_NONE && l->parent[x] != h)
+		x = l->parent[x];
+	return x;
+}
+
+static void layout_loop(block_layout *l, ssa_ref h)
+{
+	for (idx_t k = 0; k < l->cfg->num_reachable; k++) {
+		ssa_ref b = l->cfg->rpo[k];
+		if (l->placed[b] || l->cold[b]) continue;
+		ssa_ref x = nested_in(l, b, h);
+		if (x == REF_NONE) continue;
+		if (x != h && l->loop[x] == x) {
+			layout_loop(l, x);
+		} else {
+			l->placed[b] = true;
+			l->out[l->len++] = b;
+		}
+	}
+}
+
+// the order the blocks are emitted in: reverse postorder, except that the body of a loop is kept
+// in one piece right after its header, and that a block which only returns and is reached from
+// one side of a branch whose other side goes on is assumed cold and moved to the end
+// the reachable blocks are written in `out`, and the loop headers flagged in `header`
+static idx_t ir2_layout(const ir3_cfg *cfg, ssa_ref *out, bool *header, allocator *a)
+{
+	idx_t n = cfg->num_blocks;
+	allocation m = ALLOC(a, 4 * n * sizeof(ssa_ref) + 2*n + 1, alignof(ssa_ref));
+	block_layout l = { .cfg=cfg, .loop=m.addr, .out=out };
+	l.parent = l.loop + n;
+	ssa_ref *stack = l.parent + n;
+	l.placed = (bool*) (stack + 2*n);
+	l.cold = l.placed + n;
+	for (idx_t b = 0; b < n; b++) {
+		l.loop[b] = l.parent[b] = REF_NONE;
+		l.placed[b] = l.cold[b] = header[b] = false;
+	}
+
+	// natural loops, the inner ones first as their header comes later in reverse postorder
+	for (idx_t k = cfg->num_reachable; k--; ) {
+		ssa_ref h = cfg->rpo[k];
+		idx_t top = 0;
+		for (idx_t p = cfg->pred_begin[h]; p < cfg->pred_begin[h+1]; p++)
+			if (cfg_dominates(cfg, h, cfg->preds[p])) stack[top++] = cfg->preds[p];
+		if (!top) continue;
+		header[h] = true;
+		l.loop[h] = h;
+		while (top) {
+			ssa_ref b = stack[--top];
+			if (l.loop[b] == REF_NONE) {
+				l.loop[b] = h;
+			} else {
+				// already in a loop: skip to the outermost one, unless it is this one
+				ssa_ref inner = l.loop[b];
+				while (l.parent[inner] != REF_NONE) inner = l.parent[inner];
+				if (inner == h) continue;
+				l.parent[inner] = h;
+				b = inner;
+			}
+			for (idx_t p = cfg->pred_begin[b]; p < cfg->pred_begin[b+1]; p++)
+				stack[top++] = cfg->preds[p];
+		}
+	}
+
+	for (idx_t k = 0; k < cfg->num_reachable; k++) {
+		ssa_ref b = cfg->rpo[k];
+		if (cfg->succ[b][1] == REF_NONE) continue;
+		for (int s = 0; s < 2; s++) {
+			ssa_ref c = cfg->succ[b][s], other = cfg->succ[b][!s];
+			if (cfg->succ[c][0] == REF_NONE && cfg->succ[other][0] != REF_NONE
+			&& cfg->pred_begin[c+1] - cfg->pred_begin[c] == 1)
+				l.cold[c] = true;
+		}
+	}
+
+	layout_loop(&l, REF_NONE);
+	for (idx_t k = 0; k < cfg->num_reachable; k++)
+		if (l.cold[cfg->rpo[k]]) out[l.len++] = cfg->rpo[k];
+	DEALLOC(a, m);
+	return l.len;
 }
 
 static void ir2_decl_func(ir3_func *dst, ir3_func *src, allocator *a)
@@ -586,51 +824,70 @@ static void ir2_decl_func(ir3_func *dst, ir3_func *src, allocator *a)
 	dyn_arr_init(&dst->ins, 0, a);
 	dyn_arr_init(&dst->nodes, 0, a); // just lazy to make a new type without them
 	dst->locals = src->locals;
-	for (const ir3_node *start = src->nodes.buf.addr, *node = start; node != src->nodes.end; node++) {
-		dyn_arr_push(&dst->ins, &(ssa_instr){ .kind=SSA_LABEL, node-start }, sizeof(ssa_instr), a);
-		for (const ssa_instr *instr = src->ins.buf.addr + node->begin, *end = src->ins.buf.addr + node->end; instr != end; instr++) switch (instr->kind) {
-		case SSA_IMM:
-		case SSA_SET:
-		case SSA_GLOBAL_REF:
-			dyn_arr_push(&dst->ins, instr, sizeof *instr, a);
-			instr++;
-			/* fallthrough */
-		case SSA_COPY:
-		case SSA_BOOL:
-		case SSA_RET:
-		case SSA_GOTO:
-		case SSA_ARG:
-		case SSA_BOOL_NEG:
-		case SSA_LOAD: case SSA_STORE: case SSA_ADDRESS:
-		case SSA_MEMCOPY:
-		case SSA_CONVERT:
-		case SSA_OFFSETOF:
-			dyn_arr_push(&dst->ins, instr, sizeof *instr, a);
-			break;
-		case SSA_ADD:
-		case SSA_SUB:
-		case SSA_MUL: // x86 mul/imul are a reminder that RAX was the accumulator // basically they are 1-address (can be 2/3 for imul)
-			dyn_arr_push(&dst->ins, &(ssa_instr){ .kind=SSA_COPY, instr->to, instr->L }, sizeof *instr, a);
-			dyn_arr_push(&dst->ins, &(ssa_instr){ .kind=instr->kind, instr->to, instr->to, instr->R }, sizeof *instr, a);
-			break;
-		case SSA_BR:
-			dyn_arr_push(&dst->ins, &(ssa_instr){ .kind=SSA_BR, instr->to, instr->L, instr->R }, sizeof *instr, a);
-			dyn_arr_push(&dst->ins, &(ssa_instr){ .L=instr[1].L }, sizeof *instr, a);
-			dyn_arr_push(&dst->ins, &(ssa_instr){ .kind=SSA_GOTO, instr[1].R }, sizeof(ssa_instr), a);
-			instr++;
-			break;
-		case SSA_CALL:
-			{
-			idx_t ratio = sizeof(ssa_extension) / sizeof(ssa_ref);
-			idx_t num_ext = (instr->R + ratio - 1) / ratio + 1;
-			dyn_arr_push(&dst->ins, instr, (1 + num_ext) * sizeof *instr, a);
-			instr += num_ext;
+	ir3_cfg cfg;
+	cfg_init(&cfg, src, a);
+	allocation m = ALLOC(a, cfg.num_blocks * (sizeof(ssa_ref) + 1) + 1, alignof(ssa_ref));
+	ssa_ref *layout = m.addr;
+	bool *header = (bool*) (layout + cfg.num_blocks);
+	idx_t num_placed = ir2_layout(&cfg, layout, header, a);
+	const ir3_node *nodes = src->nodes.buf.addr;
+	for (idx_t k = 0; k < num_placed; k++) {
+		ssa_ref b = layout[k];
+		// loop headers want to start a fetch block
+		dyn_arr_push(&dst->ins, &(ssa_instr){ .kind=SSA_LABEL, b, header[b]? 16: 0 }, sizeof(ssa_instr), a);
+		bool terminated = false;
+		for (const ssa_instr *instr = src->ins.buf.addr + nodes[b].begin, *end = src->ins.buf.addr + cfg.ends[b]; instr != end; instr++) {
+			terminated = ssa_is_terminator(instr);
+			switch (instr->kind) {
+			case SSA_IMM:
+			case SSA_SET:
+			case SSA_GLOBAL_REF:
+			case SSA_LEA: // both are 3-address on x86 as well
+			case SSA_MULI:
+				dyn_arr_push(&dst->ins, instr, sizeof *instr, a);
+				instr++;
+				/* fallthrough */
+			case SSA_COPY:
+			case SSA_BOOL:
+			case SSA_RET:
+			case SSA_GOTO:
+			case SSA_ARG:
+			case SSA_BOOL_NEG:
+			case SSA_LOAD: case SSA_STORE: case SSA_ADDRESS:
+			case SSA_MEMCOPY:
+			case SSA_CONVERT:
+			case SSA_OFFSETOF:
+				dyn_arr_push(&dst->ins, instr, sizeof *instr, a);
+				break;
+			case SSA_ADD:
+			case SSA_SUB:
+			case SSA_MUL: // x86 mul/imul are a reminder that RAX was the accumulator // basically they are 1-address (can be 2/3 for imul)
+				dyn_arr_push(&dst->ins, &(ssa_instr){ .kind=SSA_COPY, instr->to, instr->L }, sizeof *instr, a);
+				dyn_arr_push(&dst->ins, &(ssa_instr){ .kind=instr->kind, instr->to, instr->to, instr->R }, sizeof *instr, a);
+				break;
+			case SSA_BR:
+				dyn_arr_push(&dst->ins, &(ssa_instr){ .kind=SSA_BR, instr->to, instr->L, instr->R }, sizeof *instr, a);
+				dyn_arr_push(&dst->ins, &(ssa_instr){ .L=instr[1].L }, sizeof *instr, a);
+				dyn_arr_push(&dst->ins, &(ssa_instr){ .kind=SSA_GOTO, instr[1].R }, sizeof(ssa_instr), a);
+				instr++;
+				break;
+			case SSA_CALL:
+				{
+				idx_t num_ext = ssa_ext_len(instr);
+				dyn_arr_push(&dst->ins, instr, (1 + num_ext) * sizeof *instr, a);
+				instr += num_ext;
+				}
+				break;
+			default:
+				assert(0);
 			}
-			break;
-		default:
-			assert(0);
 		}
+		// the blocks are not in their original order anymore, nothing falls through
+		if (!terminated && cfg.succ[b][0] != REF_NONE)
+			dyn_arr_push(&dst->ins, &(ssa_instr){ .kind=SSA_GOTO, cfg.succ[b][0] }, sizeof(ssa_instr), a);
 	}
+	DEALLOC(a, m);
+	cfg_fini(&cfg, a);
 	dst->num_labels = dyn_arr_size(&src->nodes) / sizeof(ir3_node);
 	dyn_arr_fini(&src->ins, a);
 	dyn_arr_fini(&src->nodes, a);
@@ -669,43 +926,67 @@ static void ir3_fini(ir3_module m, allocator *a)
 	scratch_fini(m, a);
 }
 
-void test_3ac(void)
+// compiles the file all the way and runs its `entry` right here, which has to return `expect`.
+// the object file and the executable are only written if they're named
+static void test_3ac_file(const char *path, MAYBE_UNUSED int32_t expect, const char *obj, const char *exe)
 {
-	extern int printf(const char *, ...);
-	printf("==3AC==\n");
-
+	MAYBE_UNUSED bool ran = false;
 	allocator *gpa = (allocator*)&malloc_allocator;
 	ast_init(gpa);
 	allocator_geom perma; allocator_geom_init(&perma, 16, 8, 0x100, gpa);
-	token_init("nyan/simpler.nyan", ast.temps, &perma.base);
+	token_init(path, ast.temps, &perma.base);
 	allocator_geom just_ast; allocator_geom_init(&just_ast, 10, 8, 0x100, gpa);
-	module_t module = parse_module(&just_ast.base);
+	module_t module = parse_module(4, &just_ast.base);
 	scope global;
 	resolve_refs(module, &global, ast.temps, &perma.base);
 	type_init(gpa);
-	type_check(module, &global, &just_ast.base);
-	type_fini();
+	type_check(module, &global, 4, &just_ast.base);
 	token_fini();
 
 	if (!ast.errors) {
 		bytecode_init(gpa);
-		ir3_module m3ac = convert_to_3ac(module, &global, gpa);
+		ir3_module m3ac = convert_to_3ac(module, &global, 4, gpa);
+		opt_inline(m3ac, gpa);
+		convert_to_ssa(m3ac, gpa);
+		optimize(m3ac, gpa);
 
 		print(stdout, "3-address code:\n");
 		dump_3ac(m3ac, bytecode.names.buf.addr);
+		convert_from_ssa(m3ac, gpa);
 		ir3_module m2ac = convert_to_2ac(m3ac, gpa);
 		// print(stdout, "2-address code:\n");
 		// dump_3ac(m2ac, bytecode.names.buf.addr);
 
-		map_fini(&tokens.idents, tokens.up);
 		scope_fini(&global, ast.temps);
 		allocator_geom_fini(&perma);
 
-		gen_module gen = gen_x86_64(m2ac, gpa);
+		gen_module gen = gen_x86_64(m2ac, 4, gpa);
+		// the same bytes have to come out of a single thread
+		gen_module serial = gen_x86_64(m2ac, 1, gpa);
+		assert(scratch_len(serial.syms) == scratch_len(gen.syms) && serial.code_size == gen.code_size);
+		for (gen_sym *p = scratch_start(gen.syms), *q = scratch_start(serial.syms); p != scratch_end(gen.syms); p++, q++)
+			assert(p->kind != GEN_CODE || (scratch_len(p->ins) == scratch_len(q->ins)
+				&& !memcmp(scratch_start(p->ins), scratch_start(q->ins), scratch_len(p->ins))));
+		gen_fini(&serial, gpa);
 		allocator_geom_fini(&just_ast);
 		ast_fini(gpa);
-		int e = elf_object_from(&gen, "simpler.o", &bytecode.names, gpa);
-		if (e < 0) perror("objfile not generated");
+		if (obj && elf_object_from(&gen, obj, &bytecode.names, gpa) < 0)
+			perror("objfile not generated");
+		if (exe && elf_executable_from(&gen, exe, &bytecode.names, gpa) < 0)
+			perror("executable not generated");
+		// run it right here, no linker nor process needed
+		jit_image img;
+		if (jit_load(&img, &gen, gpa) < 0) perror("module not loaded");
+		else {
+			int32_t (*entry)(void) = (int32_t (*)(void)) jit_lookup(&img, &bytecode.names, "entry");
+			if (entry) {
+				int32_t got = entry();
+				print(stdout, "entry() = ", (print_int){ got }, "\n");
+				assert(got == expect);
+				ran = true;
+			}
+			jit_fini(&img, gpa);
+		}
 
 		gen_fini(&gen, gpa);
 		ir3_fini(m2ac, gpa);
@@ -715,7 +996,22 @@ void test_3ac(void)
 		}
 		bytecode_fini();
 	}
+	// the AST is done with either way
+	type_fini();
 	// FIXME: else leaks
+	assert(ran);
+}
+
+void test_3ac(void)
+{
+	extern int printf(const char *, ...);
+	printf("==3AC==\n");
+	test_3ac_file("nyan/simpler.nyan", 0, "simpler.o", "simpler");
+	// loops, constant arguments, aggregate copies, tail calls and locals only defined on dead paths:
+	// a wrong rewrite by any pass changes the sum
+	test_3ac_file("nyan/passes.nyan", 501695, NULL, NULL);
+	// a branch on a local only defined where sccp knows it never goes
+	test_3ac_file("nyan/undef_branch.nyan", 2, NULL, NULL);
 }
 
 int dump_3ac(ir3_module m, map_entry *globals)
@@ -1,11 +1,16 @@
+#define _POSIX_C_SOURCE 200809L // open_memstream
 #include "ast.h"
 #include "scope.h"
 #include "print.h"
 #include "type_check.h"
 #include "token.h"
+#include "pool.h"
 
 #include <assert.h>
 #include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
 
 
 type type_none  = { .kind=TYPE_NONE,  .size=0, .align=1 };
@@ -18,7 +23,7 @@ struct ast_state_t ast;
 
 void ast_one_more_error(void)
 {
-	ast.errors++;
+	atomic_fetch_add_explicit(&ast.errors, 1, memory_order_relaxed);
 }
 
 int ast_init(allocator *up)
@@ -26,14 +31,31 @@ int ast_init(allocator *up)
 	ast.temps = up;
 	ast.errors = 0;
 	dyn_arr_init(&ast.decls, 0*sizeof(decl*), up);
+	ast.arenas = ALLOC_FAILURE;
+	ast.num_arenas = 0;
 	return 0;
 }
 
 void ast_fini(allocator *up)
 {
 	dyn_arr_fini(&ast.decls, up);
+	for (allocator_geom *g = ast.arenas.addr, *end = g + ast.num_arenas; g != end; g++)
+		allocator_geom_fini(g);
+	if (ast.arenas.addr) DEALLOC(up, ast.arenas);
 }
 
+// the declarations of a chunk of the source parsed on its own, numbered from 0 until they are merged
+typedef struct decl_sink {
+	dyn_arr decls; // decl*
+	dyn_arr refs; // decl_idx*, where the chunk holds one
+	dyn_arr module; // decl_idx
+	char *diag;
+	size_t diag_len;
+	source_idx begin, end;
+} decl_sink;
+
+static _Thread_local decl_sink *sink;
+
 static stmt *parse_stmt(allocator *up);
 static stmt_block parse_stmt_block(allocator *up);
 static decl_idx parse_decl(allocator *up);
@@ -59,9 +81,10 @@ static decl_assoc new_decl(allocator *a, source_idx pos, ident_t name)
 	d->name = name;
 	d->pos  = pos ;
 	d->id = -1;
-	idx_t i = ast.decls.end - ast.decls.buf.addr;
+	dyn_arr *decls = sink? &sink->decls: &ast.decls;
+	idx_t i = decls->end - decls->buf.addr;
 	decl_assoc pair = { .ptr=d, .i=i/sizeof(decl*) };
-	dyn_arr_push(&ast.decls, &d, sizeof d, ast.temps);
+	dyn_arr_push(decls, &d, sizeof d, ast.temps);
 	return pair;
 }
 
@@ -96,6 +119,7 @@ static type *new_type(allocator *up)
 	t->kind = TYPE_NONE;
 	t->id = -1;
 	t->size = -1;
+	t->align = 0;
 	return t;
 }
 
@@ -105,6 +129,7 @@ type *type_ptr(allocator *up, type *base)
 	t->kind = TYPE_PTR;
 	t->base = base;
 	t->size = 8;
+	t->align = 8;
 	return t;
 }
 
@@ -115,7 +140,7 @@ expr *parse_expr_atom(allocator *up)
 		if (token_expect(')')) return e;
 	}
 	expr *atom = new_expr(up);
-	token snapshot = tokens.current;
+	token snapshot = lexer.current;
 	atom->pos = snapshot.pos;
 	if (token_match_kw(tokens.kw_undef)) {
 		atom->kind = EXPR_UNDEF;
@@ -168,7 +193,7 @@ expr *parse_expr_postfix(allocator *up)
 		if (!token_expect(']')) goto err;
 		operand = deref;
 	} else if (token_match('.')) {
-		ident_t name = tokens.current.processed;
+		ident_t name = lexer.current.processed;
 		if (!token_expect(TOKEN_NAME)) goto err;
 		expr *aggr = new_expr(up);
 		aggr->kind = EXPR_FIELD;
@@ -183,7 +208,7 @@ err:
 
 expr *parse_expr_prefix(allocator *up)
 {
-	token snapshot = tokens.current;
+	token snapshot = lexer.current;
 	if (token_match_precedence('!')) {
 		expr *pre = new_expr(up);
 		switch (snapshot.kind) {
@@ -202,7 +227,7 @@ expr *parse_expr_prefix(allocator *up)
 expr *parse_expr_add(allocator *up)
 {
 	expr *L = parse_expr_prefix(up);
-	token snapshot = tokens.current;
+	token snapshot = lexer.current;
 	while (token_match_precedence('+')) {
 		token_kind kind = snapshot.kind;
 		assert(kind == '+' || kind == '-');
@@ -214,7 +239,7 @@ expr *parse_expr_add(allocator *up)
 		sum->kind = EXPR_ADD;
 		sum->pos = snapshot.pos;
 		L = sum;
-		snapshot = tokens.current;
+		snapshot = lexer.current;
 	}
 	return L;
 }
@@ -222,7 +247,7 @@ expr *parse_expr_add(allocator *up)
 expr *parse_expr_cmp(allocator *up)
 {
 	expr *L = parse_expr_add(up);
-	token snapshot = tokens.current;
+	token snapshot = lexer.current;
 	if (token_match_precedence(TOKEN_EQ)) {
 		token_kind kind = snapshot.kind;
 		expr *R = parse_expr_add(up); // no a == b == c
@@ -279,7 +304,7 @@ expr *parse_expr(allocator *up)
 
 static decl parse_decl_unset(allocator *up)
 {
-	decl d = { .kind=DECL_NONE, .name=tokens.current.processed, .pos=tokens.current.pos };
+	decl d = { .kind=DECL_NONE, .name=lexer.current.processed, .pos=lexer.current.pos };
 	if (!token_expect(TOKEN_NAME)) goto err;
 	if (!token_expect(':')) goto err;
 	d.type = parse_type(up);
@@ -291,7 +316,7 @@ err:
 type *parse_type_prim(allocator *up)
 {
 	type *prim;
-	token snapshot = tokens.current;
+	token snapshot = lexer.current;
 	if (token_match_kw(tokens.kw_func)) {
 		prim = new_type(up);
 		prim->kind = TYPE_FUNC;
@@ -308,7 +333,7 @@ type *parse_type_prim(allocator *up)
 		prim->kind = TYPE_NAME;
 		prim->name = snapshot.processed;
 	} else {
-		if (!expect_or(false, token_pos(), "unknown type ", tokens.current, "\n"))
+		if (!expect_or(false, token_pos(), "unknown type ", lexer.current, "\n"))
 			token_skip_to_newline();
 		prim = &type_none;
 	}
@@ -405,6 +430,7 @@ stmt *parse_stmt(allocator *up)
 		if (token_is(TOKEN_NAME) && lookahead_is(':')) {
 			s->kind = STMT_DECL;
 			s->d = parse_decl(up);
+			if (sink) dyn_arr_push(&sink->refs, &(decl_idx*){ &s->d }, sizeof(decl_idx*), ast.temps);
 		} else {
 			s->kind = STMT_EXPR;
 			s->e = parse_expr(up);
@@ -424,7 +450,7 @@ err:
 
 decl_idx parse_decl(allocator *up)
 {
-	token snapshot = tokens.current;
+	token snapshot = lexer.current;
 	decl_assoc pair = new_decl(up, snapshot.pos, snapshot.processed);
 	decl *d = pair.ptr;
 	if (!token_expect(TOKEN_NAME)) goto err;
@@ -471,7 +497,43 @@ decl_idx parse_decl(allocator *up)
 	return pair.i;
 }
 
-module_t parse_module(allocator *up)
+static bool source_ident(char c) { return isalnum(c) || c == '_'; }
+
+// skips the spaces and the comments
+static source_idx source_skip(source_idx at)
+{
+	const char *src = tokens.base;
+	while (true) {
+		if (isspace(src[at])) at++;
+		else if (src[at] == '/' && src[at+1] == '/')
+			while (src[at] && src[at] != '\n') at++;
+		else return at;
+	}
+}
+
+// where each top-level declaration starts, from the braces alone: one ends with the `}` or the `;`
+// that closes its nesting, when a name follows; nothing but the start of the source if they don't match
+static void split_decls(dyn_arr *starts, allocator *a)
+{
+	const char *src = tokens.base;
+	dyn_arr_push(starts, &(source_idx){ 0 }, sizeof(source_idx), a);
+	idx_t depth = 0;
+	for (source_idx at = source_skip(0); src[at]; at = source_skip(at)) {
+		char c = src[at++];
+		if (c == '{' || c == '(' || c == '[') depth++;
+		else if (c == '}' || c == ')' || c == ']') {
+			if (--depth < 0) break;
+		} else if (source_ident(c)) {
+			while (source_ident(src[at])) at++;
+			continue;
+		}
+		if (depth == 0 && (c == '}' || c == ';') && (isalpha(src[source_skip(at)]) || src[source_skip(at)] == '_'))
+			dyn_arr_push(starts, &at, sizeof at, a);
+	}
+	if (depth != 0) starts->end = starts->buf.addr + sizeof(source_idx);
+}
+
+static module_t parse_decls(allocator *up)
 {
 	dyn_arr m;
 	dyn_arr_init(&m, 0*sizeof(decl*), ast.temps);
@@ -482,6 +544,91 @@ module_t parse_module(allocator *up)
 	return scratch_from(&m, ast.temps, up);
 }
 
+typedef struct parse_job {
+	decl_sink *sinks;
+	allocator_geom *arenas;
+} parse_job;
+
+static void parse_chunk(void *ctx, size_t i, int worker)
+{
+	parse_job *job = ctx;
+	decl_sink *s = &job->sinks[i];
+	allocator *up = &job->arenas[worker].base;
+	// straight to stderr if it can't be buffered
+	FILE *prev = diag_redirect(open_memstream(&s->diag, &s->diag_len));
+	dyn_arr_init(&s->decls, 0, ast.temps);
+	dyn_arr_init(&s->refs, 0, ast.temps);
+	dyn_arr_init(&s->module, 0, ast.temps);
+	sink = s;
+	token_seek(s->begin, s->end);
+	do {
+		decl_idx d = parse_decl(up);
+		dyn_arr_push(&s->module, &d, sizeof d, ast.temps);
+	} while (!token_done());
+	sink = NULL;
+	FILE *f = diag_redirect(prev);
+	if (f) fclose(f);
+}
+
+module_t parse_module(int jobs, allocator *up)
+{
+	dyn_arr starts;
+	dyn_arr_init(&starts, 0, ast.temps);
+	split_decls(&starts, ast.temps);
+	source_idx *start = starts.buf.addr;
+	idx_t num_decls = dyn_arr_size(&starts) / sizeof *start;
+	jobs = parallel_jobs(num_decls, jobs);
+	if (jobs == 1) {
+		dyn_arr_fini(&starts, ast.temps);
+		return parse_decls(up);
+	}
+
+	// a few chunks per thread, of about the same size, to even out the work
+	source_idx source_len = tokens.len - 0x1000;
+	source_idx chunk_len = source_len / (4 * jobs) + 1;
+	dyn_arr chunks;
+	dyn_arr_init(&chunks, 0, ast.temps);
+	for (idx_t d = 0; d < num_decls; d++) {
+		decl_sink *last = dyn_arr_empty(&chunks)? NULL: (decl_sink*) chunks.end - 1;
+		if (last && start[d] - last->begin < chunk_len) continue;
+		if (last) last->end = start[d];
+		dyn_arr_push(&chunks, &(decl_sink){ .begin=start[d] }, sizeof(decl_sink), ast.temps);
+	}
+	((decl_sink*) chunks.end - 1)->end = source_len;
+	dyn_arr_fini(&starts, ast.temps);
+	idx_t num_chunks = dyn_arr_size(&chunks) / sizeof(decl_sink);
+
+	jobs = parallel_jobs(num_chunks, jobs);
+	allocation a = REALLOC(ast.temps, ast.arenas, (ast.num_arenas + jobs) * sizeof(allocator_geom), alignof(allocator_geom));
+	ast.arenas = a;
+	allocator_geom *arenas = (allocator_geom*) a.addr + ast.num_arenas;
+	for (int w = 0; w < jobs; w++)
+		allocator_geom_init(&arenas[w], 10, 8, 0x100, ast.temps);
+	ast.num_arenas += jobs;
+	parse_job job = { chunks.buf.addr, arenas };
+	parallel_for(num_chunks, jobs, parse_chunk, &job);
+	// the position of the current thread is left as if it had parsed everything itself
+	token_seek(source_len, source_len);
+
+	dyn_arr m;
+	dyn_arr_init(&m, 0*sizeof(decl*), ast.temps);
+	for (decl_sink *s = chunks.buf.addr; s != chunks.end; s++) {
+		decl_idx base = dyn_arr_size(&ast.decls) / sizeof(decl*);
+		dyn_arr_push(&ast.decls, s->decls.buf.addr, dyn_arr_size(&s->decls), ast.temps);
+		for (decl_idx **ref = s->refs.buf.addr; ref != s->refs.end; ref++)
+			**ref += base;
+		for (decl_idx *d = s->module.buf.addr; d != s->module.end; d++)
+			dyn_arr_push(&m, &(decl_idx){ *d + base }, sizeof *d, ast.temps);
+		if (s->diag_len) fwrite(s->diag, 1, s->diag_len, diag_stream());
+		free(s->diag);
+		dyn_arr_fini(&s->decls, ast.temps);
+		dyn_arr_fini(&s->refs, ast.temps);
+		dyn_arr_fini(&s->module, ast.temps);
+	}
+	dyn_arr_fini(&chunks, ast.temps);
+	return scratch_from(&m, ast.temps, up);
+}
+
 void test_ast(void)
 {
 	// TODO: change print a bit
@@ -492,16 +639,15 @@ void test_ast(void)
 	allocator_geom perma;
 	allocator_geom_init(&perma, 16, 8, 0x100, gpa);
 	token_init("nyan/basic.nyan", ast.temps, &perma.base);
-	module_t module = parse_module(&perma.base);
+	module_t module = parse_module(4, &perma.base);
 	scope global;
 	resolve_refs(module, &global, ast.temps, &perma.base);
 	type_init(gpa);
-	type_check(module, &global, &perma.base);
+	type_check(module, &global, 4, &perma.base);
 	type_fini();
 
 	scope_fini(&global, gpa);
 	token_fini();
-	map_fini(&tokens.idents, gpa);
 	allocator_geom_fini(&perma);
 	ast_fini(gpa);
 	if (!ast.errors) printf("  no news is good news.\n");
@@ -1,4 +1,5 @@
 #include "gen/elf64.h"
+#include "map.h"
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -6,6 +7,8 @@
 #include <unistd.h>
 #include <elf.h>
 #include <string.h>
+#include <errno.h>
+#include <assert.h>
 // TODO: remove
 #include <stdio.h>
 
@@ -72,7 +75,7 @@ int elf_object_from(const gen_module *mod, const char *path, const dyn_arr *name
 	shdr[SECTION_SYMTAB].sh_offset = out.end - out.buf.addr;
 	shdr[SECTION_SYMTAB].sh_size = (scratch_len(mod->syms) / sizeof(gen_sym) + 1) * sizeof(Elf64_Sym);
 	shdr[SECTION_SYMTAB].sh_link = SECTION_STRTAB;
-	shdr[SECTION_SYMTAB].sh_info = 1; // 3 in objdump
+	shdr[SECTION_SYMTAB].sh_info = 1; // one past the last local, set later
 	shdr[SECTION_SYMTAB].sh_addralign = 8;
 	shdr[SECTION_SYMTAB].sh_entsize = sizeof(Elf64_Sym);
 
@@ -145,19 +148,27 @@ int elf_object_from(const gen_module *mod, const char *path, const dyn_arr *name
 	dyn_arr_push(&out, &(char){ '\0' }, 1, a);
 	size_t text_offset = 0;
 	size_t r_idx = 0;
+	// the .rodata blobs are only ever referenced from this file, they go first as locals
+	size_t num_syms = scratch_len(mod->syms) / sizeof(gen_sym);
+	allocation m = ALLOC(a, (num_syms ? num_syms : 1) * sizeof(size_t), alignof(size_t));
+	size_t *slot = m.addr, num_locals = 0;
+	for (gen_sym *start = scratch_start(mod->syms), *end = scratch_end(mod->syms), *it = start; it != end; it++)
+		if (it->kind == GEN_RODATA) slot[it - start] = 1 + num_locals++;
+	for (gen_sym *start = scratch_start(mod->syms), *end = scratch_end(mod->syms), *it = start, *next = start; it != end; it++)
+		if (it->kind == GEN_CODE) slot[it - start] = 1 + num_locals + next++ - start;
 	map_entry *n = names->buf.addr;
 	for (gen_sym *start = scratch_start(mod->syms), *end = scratch_end(mod->syms), *it = start;
 			it != end; it++) {
 		size_t idx = it - start;
 		ehdr = out.buf.addr;
 		shdr = out.buf.addr + ehdr->e_shoff;
-		Elf64_Sym *sym = out.buf.addr + shdr[SECTION_SYMTAB].sh_offset + (1+idx) * sizeof *sym;
+		Elf64_Sym *sym = out.buf.addr + shdr[SECTION_SYMTAB].sh_offset + slot[idx] * sizeof *sym;
 		sym->st_name = strtab_offset;
 		strtab_offset += n->v + 1;
 		sym->st_other = STV_DEFAULT;
 
 		if (it->kind == GEN_RODATA) {
-			sym->st_info = ELF64_ST_INFO(STB_GLOBAL, STT_OBJECT);
+			sym->st_info = ELF64_ST_INFO(STB_LOCAL, STT_OBJECT);
 			sym->st_shndx = SECTION_RODATA;
 			sym->st_value = it->index;
 			sym->st_size = it->size;
@@ -175,7 +186,7 @@ int elf_object_from(const gen_module *mod, const char *path, const dyn_arr *name
 			Elf64_Rela *reloc = out.buf.addr + shdr[SECTION_RELA_TEXT].sh_offset + r_idx * sizeof *reloc;
 			reloc->r_offset = pair->offset + text_offset;
 			idx_t *renum = scratch_start(mod->renum);
-			reloc->r_info = ELF64_R_INFO(renum[pair->symref], R_X86_64_PC32);
+			reloc->r_info = ELF64_R_INFO(slot[renum[pair->symref]-1], R_X86_64_PC32);
 			reloc->r_addend = -4; // e8 @00 00 00 00 $ // you write at @ but the cpu executes the call at $ hence -4
 			// also true for any ins with a disp32 field (and no immediate, otherwise also substract the immediate's width)
 			r_idx++;
@@ -186,7 +197,11 @@ int elf_object_from(const gen_module *mod, const char *path, const dyn_arr *name
 		dyn_arr_push(&out, (char*) n->k, n->v+1, a);
 		n++;
 	}
+	ehdr = out.buf.addr;
+	shdr = out.buf.addr + ehdr->e_shoff;
+	shdr[SECTION_SYMTAB].sh_info = 1 + num_locals;
 	shdr[SECTION_STRTAB].sh_size = strtab_offset;
+	DEALLOC(a, m);
 
 	for (size_t written = 0, to_write = out.end - out.buf.addr; written < to_write; ) {
 		ssize_t w = write(fd, out.buf.addr + written, to_write - written);
@@ -204,3 +219,131 @@ fail_open:
 	return status;
 }
 
+
+// same place as ld's default, then .text on the next page and .rodata on the page after the code
+#define EXEC_BASE 0x400000
+#define EXEC_PAGE 0x1000
+
+int elf_executable_from(const gen_module *mod, const char *path, const dyn_arr *names, allocator *a)
+{
+	int status = -1;
+	// what rt.asm does: `call entry; mov rdi, rax; mov eax, 60; syscall`, padded like the functions
+	static const byte start[16] = {
+		0xe8, 0, 0, 0, 0,
+		0x48, 0x89, 0xc7,
+		0xb8, 0x3c, 0, 0, 0,
+		0x0f, 0x05,
+		0xcc,
+	};
+	gen_sym *syms = scratch_start(mod->syms);
+	size_t num_syms = scratch_len(mod->syms) / sizeof *syms;
+	size_t rodata_size = scratch_len(mod->rodata);
+	size_t text_offset = EXEC_PAGE;
+	size_t text_size = sizeof start + mod->code_size;
+	size_t rodata_offset = align(text_offset + text_size, EXEC_PAGE);
+	size_t num_phdr = rodata_size ? 2 : 1;
+
+	allocation m = ALLOC(a, (num_syms ? num_syms : 1) * sizeof(size_t), alignof(size_t));
+	size_t *addr = m.addr;
+	size_t entry = 0;
+	map_entry *n = names->buf.addr;
+	for (size_t i = 0, code = text_offset + sizeof start; i < num_syms; i++, n++) {
+		if (syms[i].kind == GEN_RODATA) {
+			addr[i] = EXEC_BASE + rodata_offset + syms[i].index;
+			continue;
+		}
+		assert(syms[i].kind == GEN_CODE);
+		addr[i] = EXEC_BASE + code;
+		code += scratch_len(syms[i].ins);
+		if (n->v == sizeof "entry" - 1 && !memcmp((const char*) n->k, "entry", n->v))
+			entry = addr[i];
+	}
+	if (!entry) {
+		fprintf(stderr, "no `entry` function to start from\n");
+		errno = EINVAL; // the callers perror like for the syscalls
+		goto fail_entry;
+	}
+
+	int fd = open(path, O_CREAT|O_WRONLY|O_TRUNC, S_IRWXU);
+	if (fd == -1) goto fail_entry;
+
+	dyn_arr out;
+	dyn_arr_init(&out, 0, a);
+	size_t file_size = rodata_size ? rodata_offset + rodata_size : text_offset + text_size;
+	memset(dyn_arr_push(&out, NULL, file_size, a), 0, file_size);
+
+	Elf64_Ehdr *ehdr = out.buf.addr;
+	ehdr->e_ident[EI_MAG0] = ELFMAG0;
+	ehdr->e_ident[EI_MAG1] = ELFMAG1;
+	ehdr->e_ident[EI_MAG2] = ELFMAG2;
+	ehdr->e_ident[EI_MAG3] = ELFMAG3;
+	ehdr->e_ident[EI_CLASS] = ELFCLASS64;
+	ehdr->e_ident[EI_DATA] = ELFDATA2LSB;
+	ehdr->e_ident[EI_VERSION] = EV_CURRENT;
+	ehdr->e_ident[EI_OSABI] = ELFOSABI_SYSV;
+	ehdr->e_ident[EI_ABIVERSION] = 0;
+
+	ehdr->e_type = ET_EXEC;
+	ehdr->e_machine = EM_X86_64;
+	ehdr->e_version = EV_CURRENT;
+	ehdr->e_entry = EXEC_BASE + text_offset;
+	ehdr->e_phoff = sizeof *ehdr;
+	ehdr->e_shoff = 0; // no sections, the loader only reads the segments
+	ehdr->e_flags = 0;
+	ehdr->e_ehsize = sizeof *ehdr;
+	ehdr->e_phentsize = sizeof(Elf64_Phdr);
+	ehdr->e_phnum = num_phdr;
+	ehdr->e_shentsize = 0;
+	ehdr->e_shnum = 0;
+	ehdr->e_shstrndx = SHN_UNDEF;
+
+	Elf64_Phdr *phdr = out.buf.addr + ehdr->e_phoff;
+	phdr[0].p_type = PT_LOAD;
+	phdr[0].p_flags = PF_R|PF_X;
+	phdr[0].p_offset = text_offset;
+	phdr[0].p_vaddr = phdr[0].p_paddr = EXEC_BASE + text_offset;
+	phdr[0].p_filesz = phdr[0].p_memsz = text_size;
+	phdr[0].p_align = EXEC_PAGE;
+	if (rodata_size) {
+		phdr[1].p_type = PT_LOAD;
+		phdr[1].p_flags = PF_R;
+		phdr[1].p_offset = rodata_offset;
+		phdr[1].p_vaddr = phdr[1].p_paddr = EXEC_BASE + rodata_offset;
+		phdr[1].p_filesz = phdr[1].p_memsz = rodata_size;
+		phdr[1].p_align = EXEC_PAGE;
+		memcpy(out.buf.addr + rodata_offset, scratch_start(mod->rodata), rodata_size);
+	}
+
+	// the R_X86_64_PC32 of the object file, applied: S + A - P with A = -4
+	byte *text = out.buf.addr + text_offset;
+	int32_t disp = entry - (EXEC_BASE + text_offset + 5);
+	memcpy(text, start, sizeof start);
+	memcpy(text + 1, &disp, sizeof disp);
+	idx_t *renum = scratch_start(mod->renum);
+	for (size_t i = 0; i < num_syms; i++) {
+		if (syms[i].kind != GEN_CODE) continue;
+		byte *code = out.buf.addr + (addr[i] - EXEC_BASE);
+		memcpy(code, scratch_start(syms[i].ins), scratch_len(syms[i].ins));
+		for (gen_reloc *r = scratch_start(syms[i].refs), *end = scratch_end(syms[i].refs); r != end; r++) {
+			// renum is the index in the symtab of the object file, 0 is the null symbol
+			disp = addr[renum[r->symref]-1] - (addr[i] + r->offset + 4);
+			memcpy(code + r->offset, &disp, sizeof disp);
+		}
+	}
+
+	for (size_t written = 0, to_write = out.end - out.buf.addr; written < to_write; ) {
+		ssize_t w = write(fd, out.buf.addr + written, to_write - written);
+		if (w < 0) {
+			perror("error when writing executable");
+			goto fail_write;
+		}
+		written += w;
+	}
+	status = 0;
+fail_write:
+	dyn_arr_fini(&out, a);
+	close(fd);
+fail_entry:
+	DEALLOC(a, m);
+	return status;
+}
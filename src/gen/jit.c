@@ -0,0 +1,83 @@
+#define _GNU_SOURCE
+#include "gen/jit.h"
+#include "map.h"
+
+#include <sys/mman.h>
+#include <unistd.h>
+#include <string.h>
+#include <assert.h>
+
+
+static size_t align(size_t x, size_t a) { return (x + a - 1) / a * a; }
+
+int jit_load(jit_image *img, const gen_module *mod, allocator *a)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t rodata_size = align(scratch_len(mod->rodata), page);
+	size_t size = rodata_size + align(mod->code_size, page);
+	if (!size) size = page;
+	void *base = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_ANONYMOUS|MAP_PRIVATE, -1, 0);
+	if (base == MAP_FAILED)
+		return -1;
+	img->m = (allocation){ base, size };
+	byte *rodata = base, *text = rodata + rodata_size;
+	if (scratch_len(mod->rodata))
+		memcpy(rodata, scratch_start(mod->rodata), scratch_len(mod->rodata));
+
+	gen_sym *syms = scratch_start(mod->syms);
+	idx_t num_syms = scratch_len(mod->syms) / sizeof *syms;
+	img->addrs = ALLOC(a, (num_syms ? num_syms : 1) * sizeof(void*), alignof(void*));
+	void **addrs = img->addrs.addr;
+	// first pass: place everything, the references may point forward
+	size_t text_offset = 0;
+	for (idx_t i = 0; i < num_syms; i++) {
+		if (syms[i].kind == GEN_RODATA) {
+			addrs[i] = rodata + syms[i].index;
+			continue;
+		}
+		assert(syms[i].kind == GEN_CODE);
+		addrs[i] = text + text_offset;
+		memcpy(text + text_offset, scratch_start(syms[i].ins), scratch_len(syms[i].ins));
+		text_offset += scratch_len(syms[i].ins);
+	}
+	assert(text_offset == (size_t) mod->code_size);
+
+	// second pass: what the linker does with the R_X86_64_PC32 of the object file, S + A - P with A = -4
+	idx_t *renum = scratch_start(mod->renum);
+	for (idx_t i = 0; i < num_syms; i++) {
+		if (syms[i].kind != GEN_CODE) continue;
+		for (gen_reloc *r = scratch_start(syms[i].refs), *end = scratch_end(syms[i].refs); r != end; r++) {
+			byte *p = (byte*) addrs[i] + r->offset;
+			byte *s = addrs[renum[r->symref]-1]; // renum is the index in the symtab, 0 is the null symbol
+			ptrdiff_t disp = s - (p + 4);
+			assert(INT32_MIN <= disp && disp <= INT32_MAX);
+			int32_t disp32 = disp;
+			memcpy(p, &disp32, sizeof disp32);
+		}
+	}
+
+	if (rodata_size && mprotect(rodata, rodata_size, PROT_READ) == -1)
+		goto fail;
+	if (size > rodata_size && mprotect(text, size - rodata_size, PROT_READ|PROT_EXEC) == -1)
+		goto fail;
+	return 0;
+fail:
+	jit_fini(img, a);
+	return -1;
+}
+
+void *jit_lookup(const jit_image *img, const dyn_arr *names, const char *name)
+{
+	size_t len = strlen(name);
+	void **addrs = img->addrs.addr;
+	for (map_entry *n = names->buf.addr; n != names->end; n++)
+		if ((size_t) n->v == len && !memcmp((const char*) n->k, name, len))
+			return addrs[n - (map_entry*) names->buf.addr];
+	return NULL;
+}
+
+void jit_fini(jit_image *img, allocator *a)
+{
+	munmap(img->m.addr, img->m.size);
+	DEALLOC(a, img->addrs);
+}
@@ -1,4 +1,5 @@
 #include "gen/x86-64.h"
+#include "pool.h"
 #include "type_check.h"
 #include "3ac.h"
 #include "attrs.h"
@@ -6,6 +7,7 @@
 #include <assert.h>
 #include <stdint.h>
 #include <string.h>
+#include <stdlib.h>
 
 
 enum x86_64_reg
@@ -20,7 +22,7 @@ enum prefix {
 };
 
 static byte modrm(int mod, int rm, int reg) { return mod << 6 | (reg & 7) << 3 | (rm & 7); }
-MAYBE_UNUSED static byte sib(int ss, int index, int base) { return ss << 6 | (index & 7) << 3 | (base & 7); }
+static byte sib(int ss, int index, int base) { return ss << 6 | (index & 7) << 3 | (base & 7); }
 static byte rex(int w, int r, int x, int b) { return REX | w<<3 | r<<2 | x<<1 | b<<0; }
 
 static byte *emit_imm(byte *p, uint64_t i, int bytes)
@@ -32,17 +34,35 @@ static byte *emit_imm(byte *p, uint64_t i, int bytes)
 
 static byte *emit_disp(byte *p, enum x86_64_reg r, enum x86_64_reg base, idx_t offset)
 {
-	assert(base != RSP);
-	if (offset == 0x0 && (base & 0x7) != RBP) {
-		*p++ = modrm(0, base, r);
-		return p;
-	} else if (-0x80 <= offset && offset < 0x80) {
-		*p++ = modrm(1, base, r);
-		return emit_imm(p, offset, 1);
-	} else {
-		*p++ = modrm(2, base, r);
-		return emit_imm(p, offset, 4);
-	}
+	int mod = offset == 0x0 && (base & 0x7) != RBP? 0:
+		-0x80 <= offset && offset < 0x80? 1: 2;
+	*p++ = modrm(mod, base, r);
+	// rsp and r12 can only be a base through the SIB byte
+	if ((base & 0x7) == RSP) *p++ = sib(0, RSP, base);
+	if (mod == 1) return emit_imm(p, offset, 1);
+	if (mod == 2) return emit_imm(p, offset, 4);
+	return p;
+}
+
+// [base + index*scale + disp], scale 0 when there is no index
+typedef struct x86_mem {
+	enum x86_64_reg base, index;
+	int scale;
+	idx_t disp;
+} x86_mem;
+
+static byte *emit_mem(byte *p, enum x86_64_reg r, const x86_mem *m)
+{
+	if (!m->scale) return emit_disp(p, r, m->base, m->disp);
+	assert(m->index != RSP);
+	int mod = m->disp == 0x0 && (m->base & 0x7) != RBP? 0:
+		-0x80 <= m->disp && m->disp < 0x80? 1: 2;
+	static const byte ss[9] = { [1] = 0, [2] = 1, [4] = 2, [8] = 3 };
+	*p++ = modrm(mod, RSP, r);
+	*p++ = sib(ss[m->scale], m->index, m->base);
+	if (mod == 1) return emit_imm(p, m->disp, 1);
+	if (mod == 2) return emit_imm(p, m->disp, 4);
+	return p;
 }
 
 static byte *override_if16b(byte *p, int bytes)
@@ -74,26 +94,40 @@ static byte *prefix_ifreq(byte *p, int bytes, int r, int x, int b)
 
 static byte *load(byte *p, enum x86_64_reg to, enum x86_64_reg base, idx_t offset, int bytes)
 {
-	p = prefix_ifreq(p, bytes, to, 0, 0);
+	p = prefix_ifreq(p, bytes, to, 0, base);
 	*p++ = opcode_anysize(0x8b, bytes);
 	return emit_disp(p, to, base, offset);
 }
 
-static byte *load_rbprel(byte *p, enum x86_64_reg to, idx_t offset, int bytes)
+static byte *load_rsprel(byte *p, enum x86_64_reg to, idx_t offset, int bytes)
 {
-	return load(p, to, RBP, offset, bytes);
+	return load(p, to, RSP, offset, bytes);
 }
 
 static byte *store(byte *p, enum x86_64_reg from, enum x86_64_reg base, idx_t offset, int bytes)
 {
-	p = prefix_ifreq(p, bytes, from, 0, 0);
+	p = prefix_ifreq(p, bytes, from, 0, base);
 	*p++ = opcode_anysize(0x89, bytes);
 	return emit_disp(p, from, base, offset);
 }
 
-static byte *store_rbprel(byte *p, enum x86_64_reg from, idx_t offset, int bytes)
+static byte *store_rsprel(byte *p, enum x86_64_reg from, idx_t offset, int bytes)
+{
+	return store(p, from, RSP, offset, bytes);
+}
+
+static byte *load_mem(byte *p, enum x86_64_reg to, const x86_mem *m, int bytes)
 {
-	return store(p, from, RBP, offset, bytes);
+	p = prefix_ifreq(p, bytes, to, m->scale? m->index: 0, m->base);
+	*p++ = opcode_anysize(0x8b, bytes);
+	return emit_mem(p, to, m);
+}
+
+static byte *store_mem(byte *p, enum x86_64_reg from, const x86_mem *m, int bytes)
+{
+	p = prefix_ifreq(p, bytes, from, m->scale? m->index: 0, m->base);
+	*p++ = opcode_anysize(0x89, bytes);
+	return emit_mem(p, from, m);
 }
 
 static byte *addsub(byte *p, enum x86_64_reg L, enum x86_64_reg R, enum ssa_opcode opc, int bytes)
@@ -105,14 +139,35 @@ static byte *addsub(byte *p, enum x86_64_reg L, enum x86_64_reg R, enum ssa_opco
 	return p;
 }
 
-static byte *umul(byte *p, enum x86_64_reg fac, int bytes)
+// the low half of the product does not depend on the signedness,
+// so the 2-address imul also does unsigned multiplication
+static byte *imul(byte *p, enum x86_64_reg L, enum x86_64_reg R, int bytes)
 {
-	p = prefix_ifreq(p, bytes, 0, 0, fac);
-	*p++ = opcode_anysize(0xf7, bytes);
-	*p++ = modrm(3, fac, 4); // for 1-address imul, opcode extension is 5
+	if (bytes == 1) bytes = 4; // there is no imul r8, r/m8
+	p = prefix_ifreq(p, bytes, L, 0, R);
+	*p++ = 0x0f;
+	*p++ = 0xaf;
+	*p++ = modrm(3, R, L);
 	return p;
 }
 
+static byte *shl_imm(byte *p, enum x86_64_reg r, int count, int bytes)
+{
+	p = prefix_ifreq(p, bytes, 0, 0, r);
+	*p++ = opcode_anysize(0xc1, bytes);
+	*p++ = modrm(3, r, 4);
+	return emit_imm(p, count, 1);
+}
+
+static byte *imul_imm(byte *p, enum x86_64_reg to, enum x86_64_reg L, int32_t imm, int bytes)
+{
+	p = prefix_ifreq(p, bytes, to, 0, L);
+	bool imm8 = -0x80 <= imm && imm < 0x80;
+	*p++ = imm8? 0x6b: 0x69;
+	*p++ = modrm(3, L, to);
+	return emit_imm(p, imm, imm8? 1: 4);
+}
+
 static byte *addsubimm(byte *p, enum x86_64_reg r, idx_t imm, enum ssa_opcode opc, int bytes)
 {
 	byte opcode_ext = opc == SSA_ADD? 0: opc == SSA_SUB? 5: -1;
@@ -161,10 +216,10 @@ static byte *mov_imm(byte *p, enum x86_64_reg r, int64_t imm, int bytes)
 	return emit_imm(p, imm, bytes);
 }
 
-static byte *store_rbprel_imm8(byte *p, idx_t offset, idx_t imm)
+static byte *store_rsprel_imm8(byte *p, idx_t offset, idx_t imm)
 {
 	*p++ = 0xc6;
-	return emit_imm(emit_disp(p, 0, RBP, offset), imm, 1);
+	return emit_imm(emit_disp(p, 0, RSP, offset), imm, 1);
 }
 
 // 2AC EQ/NE/LT/LE/GT/GE
@@ -178,11 +233,12 @@ static byte *setcc_mem(byte *p, idx_t offset, enum ssa_branch_cc cc)
 {
 	*p++ = 0x0f;
 	*p++ = 0x90 | bc2cc[cc];
-	return emit_disp(p, 0, RBP, offset);
+	return emit_disp(p, 0, RSP, offset);
 }
 
 static byte *setcc(byte *p, enum x86_64_reg reg, enum ssa_branch_cc cc)
 {
+	p = rex_ifreq(p, 1, 0, 0, reg);
 	*p++ = 0x0f;
 	*p++ = 0x90 | bc2cc[cc];
 	*p++ = modrm(3, reg, 0);
@@ -221,7 +277,7 @@ type_layout gen_layout(dyn_arr *num2t, type *back, allocator *a)
 
 static byte *cmp(byte *p, enum x86_64_reg L, enum x86_64_reg R, int bytes)
 {
-	if (bytes == 8 || L >= R8 || R >= R8) *p++ = rex(bytes==8, R>>3, 0, L>>3);
+	p = prefix_ifreq(p, bytes, R, 0, L);
 	*p++ = opcode_anysize(0x39, bytes);
 	*p++ = modrm(3, L, R);
 	return p;
@@ -229,12 +285,21 @@ static byte *cmp(byte *p, enum x86_64_reg L, enum x86_64_reg R, int bytes)
 
 static byte *test(byte *p, enum x86_64_reg L, enum x86_64_reg R, int bytes)
 {
-	if (bytes == 8 || L >= R8 || R >= R8) *p++ = rex(bytes==8, R>>3, 0, L>>3);
+	p = prefix_ifreq(p, bytes, R, 0, L);
 	*p++ = opcode_anysize(0x85, bytes);
 	*p++ = modrm(3, L, R);
 	return p;
 }
 
+// movups xmm0, [base + disp] / movups [base + disp], xmm0
+static byte *movups(byte *p, bool to_mem, enum x86_64_reg base, idx_t disp)
+{
+	p = rex_ifreq(p, 4, 0, 0, base);
+	*p++ = 0x0f;
+	*p++ = to_mem? 0x11: 0x10;
+	return emit_disp(p, 0, base, disp);
+}
+
 static byte *lea(byte *p, enum x86_64_reg res, enum x86_64_reg base, idx_t disp32, int bytes)
 {
 	assert(bytes == 2 || bytes == 4 || bytes == 8);
@@ -244,6 +309,34 @@ static byte *lea(byte *p, enum x86_64_reg res, enum x86_64_reg base, idx_t disp3
 	return emit_disp(p, res, base, disp32);
 }
 
+static byte *lea_mem(byte *p, enum x86_64_reg res, const x86_mem *m, int bytes)
+{
+	assert(bytes == 4 || bytes == 8);
+	p = rex_ifreq(p, bytes, res, m->scale? m->index: 0, m->base);
+	*p++ = 0x8d;
+	return emit_mem(p, res, m);
+}
+
+// to = L * imm, without the latency of imul when a shift or a lea does it
+// the narrow widths are done on 32 bits, only their low bits are ever read
+static byte *muli(byte *p, enum x86_64_reg to, enum x86_64_reg L, int32_t imm, int bytes)
+{
+	if (bytes < 4) bytes = 4;
+	int shift = 0;
+	int64_t odd = imm;
+	while (odd > 0 && !(odd & 1)) odd >>= 1, shift++;
+	if (odd == 1 || odd == 3 || odd == 5 || odd == 9) {
+		if (odd == 1) {
+			if (to != L) p = mov(p, to, L, 8);
+		} else {
+			p = lea_mem(p, to, &(x86_mem){ .base=L, .index=L, .scale=odd-1 }, bytes);
+		}
+		if (shift) p = shl_imm(p, to, shift, bytes);
+		return p;
+	}
+	return imul_imm(p, to, L, imm, bytes);
+}
+
 static byte *emit_rip_disp(byte *p, enum x86_64_reg r, idx_t disp32)
 {
 	*p++ = modrm(0, RBP, r);
@@ -259,22 +352,27 @@ static byte *lea_rip(byte *p, enum x86_64_reg res, idx_t disp32, int bytes)
 	return emit_rip_disp(p, res, disp32);
 }
 
-// for now, the conversion is done on whatever is in the A register
-static byte *convert(byte *p, ssa_ref comb)
+// movzx/movsx from a byte register: sil/dil/spl/bpl need a REX prefix
+static byte *rex_byte_src(byte *p, int w, enum x86_64_reg dst, enum x86_64_reg src)
+{
+	if (w || dst >= R8 || src >= RSP) *p++ = rex(w, dst>>3, 0, src>>3);
+	return p;
+}
+
+static byte *convert(byte *p, ssa_ref comb, enum x86_64_reg dst, enum x86_64_reg src)
 {
-	enum x86_64_reg dst = RAX, src = RAX;
 	switch (comb) {
 	case COMBINE_TYPE(TYPE_BOOL, TYPE_INT8 ):
-		p = test(p, RAX, RAX, 1);
-		p = setcc(p, RAX, SSAB_NE);
+		p = test(p, src, src, 1);
+		p = setcc(p, dst, SSAB_NE);
 		break;
 	case COMBINE_TYPE(TYPE_BOOL, TYPE_INT32):
-		p = test(p, RAX, RAX, 4);
-		p = setcc(p, RAX, SSAB_NE);
+		p = test(p, src, src, 4);
+		p = setcc(p, dst, SSAB_NE);
 		break;
 	case COMBINE_TYPE(TYPE_BOOL, TYPE_INT64):
-		p = test(p, RAX, RAX, 8);
-		p = setcc(p, RAX, SSAB_NE);
+		p = test(p, src, src, 8);
+		p = setcc(p, dst, SSAB_NE);
 		break;
 	case COMBINE_TYPE(TYPE_INT8, TYPE_BOOL):
 		// bool is 8 bits so nothing to do here
@@ -287,26 +385,29 @@ static byte *convert(byte *p, ssa_ref comb)
 	case COMBINE_TYPE(TYPE_INT32, TYPE_INT32):
 	case COMBINE_TYPE(TYPE_INT64, TYPE_INT64):
 		// self conversions
+		if (dst != src) p = mov(p, dst, src, 8);
 		break;
 	case COMBINE_TYPE(TYPE_INT32, TYPE_BOOL):
+		p = rex_byte_src(p, 0, dst, src);
 		*p++ = 0x0f;
 		*p++ = 0xb6; // sus
 		*p++ = modrm(3, src, dst);
 		break;
 	case COMBINE_TYPE(TYPE_INT32, TYPE_INT8 ):
+		p = rex_byte_src(p, 0, dst, src);
 		*p++ = 0x0f;
 		*p++ = 0xbe;
 		*p++ = modrm(3, src, dst);
 		break;
 	case COMBINE_TYPE(TYPE_INT64, TYPE_BOOL):
-		*p++ = rex(1, dst>>3, 0, src>>3);
+		p = rex_byte_src(p, 1, dst, src);
 		*p++ = 0x0f;
 		*p++ = 0xb6;
 		*p++ = modrm(3, src, dst);
 		break;
 	case COMBINE_TYPE(TYPE_INT64, TYPE_INT8 ):
 		// there is a REX.W, contrary to what the manual says
-		*p++ = rex(1, dst>>3, 0, src>>3);
+		p = rex_byte_src(p, 1, dst, src);
 		*p++ = 0x0f;
 		*p++ = 0xbe;
 		*p++ = modrm(3, src, dst);
@@ -319,169 +420,757 @@ static byte *convert(byte *p, ssa_ref comb)
 	default:
 		assert(0);
 	}
-#undef COMBINE
 	return p;
 }
 
 // FIXME: handle more than 6 args
 static const enum x86_64_reg sysv_arg[6] = { RDI, RSI, RDX, RCX, R8, R9 };
 
+#define REG_BIT(r) (1u << (r))
+#define NO_REG ((int8_t) -1)
+
+// rax and r11 are never handed out: they are the scratch registers that
+// reach spilled locals and break cycles in parallel moves.
+// caller-saved registers come first so that the callee-saved ones
+// (which cost a push/pop pair) only get picked for values that live across calls
+// the stack never changes size past the prologue, so the locals are reached from rsp and rbp is free
+static const enum x86_64_reg alloc_order[] = {
+	RCX, RDX, RSI, RDI, R8, R9, R10,
+	RBX, R12, R13, R14, R15, RBP,
+};
+#define SCRATCH0 RAX
+#define SCRATCH1 R11
+
+// copies whose size is known and small are unrolled: the widest moves first, then a last move
+// of the same width that overlaps the previous one for the tail
+// xmm0 is never allocated and rax is a scratch, so nothing else gets clobbered
+#define INLINE_COPY_MAX 128
+static byte *copy_inline(byte *p, enum x86_64_reg dst, idx_t dst_off, enum x86_64_reg src, idx_t size)
+{
+	if (size >= 16) {
+		for (idx_t at = 0; at < size; at += 16) {
+			if (at + 16 > size) at = size - 16;
+			p = movups(p, false, src, at);
+			p = movups(p, true, dst, dst_off + at);
+		}
+		return p;
+	}
+	int w = size >= 8? 8: size >= 4? 4: size >= 2? 2: 1;
+	for (idx_t at = 0; at < size; at += w) {
+		if (at + w > size) at = size - w;
+		p = load(p, SCRATCH0, src, at, w);
+		p = store(p, SCRATCH0, dst, dst_off + at, w);
+	}
+	return p;
+}
+
+static const uint16_t caller_saved =
+	REG_BIT(RAX) | REG_BIT(RCX) | REG_BIT(RDX) | REG_BIT(RSI) | REG_BIT(RDI)
+	| REG_BIT(R8) | REG_BIT(R9) | REG_BIT(R10) | REG_BIT(R11);
+static const uint16_t callee_saved =
+	REG_BIT(RBX) | REG_BIT(RBP) | REG_BIT(R12) | REG_BIT(R13) | REG_BIT(R14) | REG_BIT(R15);
+
+typedef struct live_block {
+	idx_t begin, end; // instruction indices, the unreachable tail is excluded
+	idx_t succ[2]; // block indices, -1 when absent
+} live_block;
+
+typedef struct live_interval {
+	idx_t begin, end; // both inclusive
+	ssa_ref local;
+	int8_t hint;
+} live_interval;
+
+typedef struct live_clobber {
+	idx_t at;
+	uint16_t regs;
+} live_clobber;
+
+typedef struct frame_info {
+	field_info *fields; // the offsets are only meaningful for locals on the stack
+	int8_t *regs; // [%i] = register holding the local, or NO_REG when it lives on the stack
+	idx_t size; // what the prologue takes off rsp, 0 when the locals fit in the red zone
+	uint16_t saved; // callee-saved registers used by the function
+} frame_info;
+
+typedef uint64_t live_set;
+#define SET_WORDS(n) (((n) + 63) / 64)
+static bool set_has(const live_set *s, idx_t i) { return s[i/64] >> (i%64) & 1; }
+static void set_add(live_set *s, idx_t i) { s[i/64] |= (live_set) 1 << (i%64); }
+
+static bool is_terminator(const ssa_instr *i) { return i->kind == SSA_GOTO || i->kind == SSA_RET; }
+
+static bool fits_register(const type *t)
+{
+	if (t->kind != TYPE_PTR && !(TYPE_PRIMITIVE_BEGIN <= t->kind && t->kind <= TYPE_PRIMITIVE_END))
+		return false;
+	return t->size == 1 || t->size == 2 || t->size == 4 || t->size == 8;
+}
+
+static int interval_cmp(const void *L, const void *R)
+{
+	const live_interval *l = L, *r = R;
+	if (l->begin != r->begin) return l->begin - r->begin;
+	return (l->local > r->local) - (l->local < r->local);
+}
+
+static void extend(live_interval *iv, idx_t at)
+{
+	if (at < iv->begin) iv->begin = at;
+	if (at > iv->end) iv->end = at;
+}
+
+// liveness is computed on the 2AC blocks, then every local is given a single
+// interval [first point where it is live, last point where it is live].
+// the intervals are then assigned registers by a linear scan (Poletto & Sarkar),
+// spilling the interval that ends last when there is no register left
+static void regalloc(frame_info *fr, ir3_func *src, allocator *a)
+{
+	idx_t n = dyn_arr_size(&src->locals) / sizeof(type*);
+	type **ltypes = src->locals.buf.addr;
+	ssa_instr *start = src->ins.buf.addr, *end = src->ins.end;
+	idx_t words = SET_WORDS(n);
+
+	dyn_arr blocks, clobbers;
+	dyn_arr_init(&blocks, 0, a);
+	dyn_arr_init(&clobbers, 0, a);
+	allocation m_lbl = ALLOC(a, (src->num_labels + 1) * sizeof(idx_t), alignof(idx_t));
+	idx_t *lbl2blk = m_lbl.addr;
+	allocation m_cand = ALLOC(a, n + 1, 1);
+	bool *candidate = m_cand.addr;
+	for (idx_t v = 0; v < n; v++)
+		candidate[v] = fits_register(ltypes[v]);
+
+	// split into blocks, and find which locals cannot live in a register
+	live_block *cur = NULL;
+	bool reachable = false;
+	for (ssa_instr *i = start; i != end; i += 1 + ssa_ext_len(i)) {
+		idx_t at = i - start;
+		if (i->kind == SSA_LABEL) {
+			if (cur && reachable) cur->succ[0] = dyn_arr_size(&blocks) / sizeof *cur; // fallthrough
+			lbl2blk[i->to] = dyn_arr_size(&blocks) / sizeof *cur;
+			cur = dyn_arr_push(&blocks, &(live_block){ at, at+1, { -1, -1 } }, sizeof *cur, a);
+			reachable = true;
+			continue;
+		}
+		if (i->kind == SSA_ADDRESS) candidate[i->L] = false;
+		if (!reachable) continue;
+		cur->end = at + 1 + ssa_ext_len(i);
+		reachable = !is_terminator(i);
+	}
+	// the successors, now that all the labels are known
+	live_block *bb = blocks.buf.addr;
+	idx_t nblocks = dyn_arr_size(&blocks) / sizeof *bb;
+	for (live_block *b = bb; b != bb + nblocks; b++) {
+		int nsucc = b->succ[0] != -1;
+		for (ssa_instr *i = start + b->begin; i != start + b->end; i += 1 + ssa_ext_len(i)) {
+			if (i->kind == SSA_GOTO) b->succ[nsucc++] = lbl2blk[i->to];
+			else if (i->kind == SSA_BR) b->succ[nsucc++] = lbl2blk[i[1].L];
+		}
+		assert(nsucc <= 2);
+	}
+
+	// gen/kill, then the usual backwards dataflow until nothing changes
+	allocation m_sets = ALLOC(a, 4 * nblocks * words * sizeof(live_set) + 1, alignof(live_set));
+	memset(m_sets.addr, 0, 4 * nblocks * words * sizeof(live_set));
+	live_set *gen = m_sets.addr, *kill = gen + nblocks*words,
+		 *live_in = kill + nblocks*words, *live_out = live_in + nblocks*words;
+	for (idx_t b = 0; b < nblocks; b++)
+		for (ssa_instr *i = start + bb[b].begin; i != start + bb[b].end; i += 1 + ssa_ext_len(i)) {
+			ssa_ref *use_end;
+			for (ssa_ref *use = ssa_uses(i, &use_end); use != use_end; use++)
+				if (!set_has(kill + b*words, *use)) set_add(gen + b*words, *use);
+			ssa_ref def = ssa_def(i);
+			if (def != REF_NONE) set_add(kill + b*words, def);
+		}
+	for (bool changed = true; changed; ) {
+		changed = false;
+		for (idx_t b = nblocks; b--; ) {
+			live_set *out = live_out + b*words, *in = live_in + b*words;
+			for (int s = 0; s < 2; s++) {
+				if (bb[b].succ[s] == -1) continue;
+				live_set *succ_in = live_in + bb[b].succ[s]*words;
+				for (idx_t w = 0; w < words; w++) out[w] |= succ_in[w];
+			}
+			for (idx_t w = 0; w < words; w++) {
+				live_set next = gen[b*words + w] | (out[w] & ~kill[b*words + w]);
+				changed |= next != in[w];
+				in[w] = next;
+			}
+		}
+	}
+
+	// intervals, hints and the points where fixed registers get clobbered
+	allocation m_iv = ALLOC(a, (n + 1) * sizeof(live_interval), alignof(live_interval));
+	live_interval *iv = m_iv.addr;
+	for (idx_t v = 0; v < n; v++)
+		iv[v] = (live_interval){ .begin=INT32_MAX, .end=-1, .local=v, .hint=NO_REG };
+	for (idx_t b = 0; b < nblocks; b++) {
+		for (idx_t v = 0; v < n; v++) {
+			if (set_has(live_in  + b*words, v)) extend(&iv[v], bb[b].begin);
+			if (set_has(live_out + b*words, v)) extend(&iv[v], bb[b].end - 1);
+		}
+		for (ssa_instr *i = start + bb[b].begin; i != start + bb[b].end; i += 1 + ssa_ext_len(i)) {
+			idx_t at = i - start;
+			ssa_ref *use_end, *first = ssa_uses(i, &use_end);
+			for (ssa_ref *use = first; use != use_end; use++) {
+				extend(&iv[*use], at);
+				if (i->kind == SSA_CALL && use - first < 6 && iv[*use].hint == NO_REG)
+					iv[*use].hint = sysv_arg[use - first];
+			}
+			ssa_ref def = ssa_def(i);
+			if (def != REF_NONE) extend(&iv[def], at);
+			if (i->kind == SSA_ARG && i->L < 6) iv[i->to].hint = sysv_arg[i->L];
+			if (i->kind == SSA_CALL)
+				dyn_arr_push(&clobbers, &(live_clobber){ at, caller_saved }, sizeof(live_clobber), a);
+			else if (i->kind == SSA_MEMCOPY && ltypes[i->to]->size > INLINE_COPY_MAX)
+				dyn_arr_push(&clobbers, &(live_clobber){ at, REG_BIT(RDI)|REG_BIT(RSI)|REG_BIT(RCX) }, sizeof(live_clobber), a);
+		}
+	}
+
+	// linear scan
+	for (idx_t v = 0; v < n; v++) fr->regs[v] = NO_REG;
+	idx_t num_iv = 0;
+	for (idx_t v = 0; v < n; v++)
+		if (candidate[v] && iv[v].end != -1) iv[num_iv++] = iv[v];
+	qsort(iv, num_iv, sizeof *iv, interval_cmp);
+	live_interval *active[sizeof alloc_order / sizeof *alloc_order];
+	int num_active = 0;
+	uint16_t free_regs = 0;
+	for (size_t r = 0; r < sizeof alloc_order / sizeof *alloc_order; r++)
+		free_regs |= REG_BIT(alloc_order[r]);
+	live_clobber *clob = clobbers.buf.addr, *clob_end = clobbers.end;
+	fr->saved = 0;
+	for (live_interval *it = iv; it != iv + num_iv; it++) {
+		// an interval that ends where this one begins is done reading its
+		// operand before the instruction writes its result
+		for (int k = 0; k < num_active; )
+			if (active[k]->end <= it->begin) {
+				free_regs |= REG_BIT(fr->regs[active[k]->local]);
+				active[k] = active[--num_active];
+			} else k++;
+		uint16_t forbidden = 0;
+		for (live_clobber *c = clob; c != clob_end; c++)
+			if (it->begin < c->at && c->at < it->end) forbidden |= c->regs;
+		uint16_t usable = free_regs & ~forbidden;
+		int8_t reg = NO_REG;
+		if (it->hint != NO_REG && (usable & REG_BIT(it->hint)))
+			reg = it->hint;
+		else for (size_t r = 0; r < sizeof alloc_order / sizeof *alloc_order; r++)
+			if (usable & REG_BIT(alloc_order[r])) {
+				reg = alloc_order[r];
+				break;
+			}
+		if (reg == NO_REG) {
+			// steal the register of the active interval that ends last, if that is not this one
+			int victim = -1;
+			for (int k = 0; k < num_active; k++) {
+				int8_t r = fr->regs[active[k]->local];
+				if (forbidden & REG_BIT(r)) continue;
+				if (victim == -1 || active[k]->end > active[victim]->end) victim = k;
+			}
+			if (victim == -1 || active[victim]->end <= it->end) continue;
+			reg = fr->regs[active[victim]->local];
+			fr->regs[active[victim]->local] = NO_REG;
+			active[victim] = it;
+		} else {
+			free_regs &= ~REG_BIT(reg);
+			active[num_active++] = it;
+		}
+		fr->regs[it->local] = reg;
+		fr->saved |= REG_BIT(reg) & callee_saved;
+	}
+
+	DEALLOC(a, m_iv);
+	DEALLOC(a, m_sets);
+	DEALLOC(a, m_cand);
+	DEALLOC(a, m_lbl);
+	dyn_arr_fini(&clobbers, a);
+	dyn_arr_fini(&blocks, a);
+}
+
+// the register holding `r`, or `scratch` if it lives on the stack
+static enum x86_64_reg home(const frame_info *fr, ssa_ref r, enum x86_64_reg scratch)
+{
+	return fr->regs[r] == NO_REG? scratch: (enum x86_64_reg) fr->regs[r];
+}
+
+// reg <- r
+static byte *fetch(byte *p, const frame_info *fr, enum x86_64_reg reg, ssa_ref r)
+{
+	if (fr->regs[r] == NO_REG) return load_rsprel(p, reg, fr->fields[r].offset, fr->fields[r].size);
+	if (fr->regs[r] == (int8_t) reg) return p;
+	return mov(p, reg, fr->regs[r], 8);
+}
+
+// r <- reg
+static byte *commit(byte *p, const frame_info *fr, ssa_ref r, enum x86_64_reg reg)
+{
+	if (fr->regs[r] == NO_REG) return store_rsprel(p, reg, fr->fields[r].offset, fr->fields[r].size);
+	if (fr->regs[r] == (int8_t) reg) return p;
+	return mov(p, fr->regs[r], reg, 8);
+}
+
+// sets the flags for a branch or a set on L against R, `test` when R is known to be 0
+static byte *compare(byte *p, const frame_info *fr, ssa_ref L, ssa_ref R, bool R_zero, int width)
+{
+	enum x86_64_reg rL = home(fr, L, SCRATCH0);
+	p = fetch(p, fr, rL, L);
+	if (R_zero) return test(p, rL, rL, width);
+	enum x86_64_reg rR = home(fr, R, SCRATCH1);
+	p = fetch(p, fr, rR, R);
+	return cmp(p, rL, rR, width);
+}
+
+// performs all of `dst[k] <- src[k]` as if they happened at once
+static byte *parallel_move(byte *p, enum x86_64_reg *dst, enum x86_64_reg *src, int n)
+{
+	bool done[n + 1];
+	int left = 0;
+	for (int k = 0; k < n; k++)
+		left += !(done[k] = dst[k] == src[k]);
+	while (left) {
+		bool progress = false;
+		for (int k = 0; k < n; k++) {
+			if (done[k]) continue;
+			bool blocked = false;
+			for (int j = 0; j < n; j++)
+				blocked |= !done[j] && j != k && src[j] == dst[k];
+			if (blocked) continue;
+			p = mov(p, dst[k], src[k], 8);
+			done[k] = progress = true;
+			left--;
+		}
+		if (progress) continue;
+		// only cycles are left, park one of their sources
+		int k = 0;
+		while (done[k]) k++;
+		enum x86_64_reg parked = src[k];
+		p = mov(p, SCRATCH0, parked, 8);
+		for (int j = 0; j < n; j++)
+			if (!done[j] && src[j] == parked) src[j] = SCRATCH0;
+	}
+	return p;
+}
+
+// whether a call leads to a ret of its result, through copies and gotos only
+// the other copies on the way are dead once the frame is gone
+static bool in_tail_position(ssa_instr *call, ssa_instr *end, ssa_instr **lbl_at)
+{
+	ssa_ref result = call->to;
+	ssa_instr *i = call + 1 + ssa_ext_len(call);
+	for (int steps = 0; i != end && steps < 16; steps++) {
+		if (i->kind == SSA_RET) return i->to == result;
+		if (i->kind == SSA_GOTO) {
+			i = lbl_at[i->to];
+			continue;
+		}
+		if (i->kind == SSA_COPY && i->L == result) result = i->to;
+		else if (i->kind == SSA_COPY && i->to == result) return false;
+		else if (i->kind != SSA_COPY && i->kind != SSA_LABEL) return false;
+		i++;
+	}
+	return false;
+}
+
+// the epilogue without the ret, rsp is back to where the caller left it
+static byte *teardown(byte *p, const frame_info *fr)
+{
+	if (fr->size) p = addsubimm(p, RSP, fr->size, SSA_ADD, 8);
+	for (int r = R15; r >= 0; r--)
+		if (fr->saved & REG_BIT(r)) p = pop64(p, r);
+	return p;
+}
+
+static byte *epilogue(byte *p, const frame_info *fr)
+{
+	p = teardown(p, fr);
+	*p++ = 0xc3;
+	return p;
+}
+
+// the recommended multi-byte nops, the longer ones are repeated
+static byte *nops(byte *p, idx_t len)
+{
+	static const byte nop[9][9] = {
+		{ 0x90 },
+		{ 0x66, 0x90 },
+		{ 0x0f, 0x1f, 0x00 },
+		{ 0x0f, 0x1f, 0x40, 0x00 },
+		{ 0x0f, 0x1f, 0x44, 0x00, 0x00 },
+		{ 0x66, 0x0f, 0x1f, 0x44, 0x00, 0x00 },
+		{ 0x0f, 0x1f, 0x80, 0x00, 0x00, 0x00, 0x00 },
+		{ 0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00 },
+		{ 0x66, 0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00 },
+	};
+	for (idx_t k; len; len -= k) {
+		k = len < 9? len: 9;
+		memcpy(p, nop[k-1], k);
+		p += k;
+	}
+	return p;
+}
+
+// the jumps are emitted as rel32 placeholders and get their final form once every label is placed:
+// gone when they land right after themselves, rel8 when the target is close enough, rel32 otherwise
+// a label that wants an alignment gets a site as well, which ends up as the padding in front of it
+enum jump_form { JUMP_GONE, JUMP_SHORT, JUMP_NEAR };
+enum { JUMP_ALWAYS = -1, JUMP_ALIGN = -2 };
+typedef struct jump_site {
+	idx_t offset; // of the placeholder
+	ssa_ref label; // the alignment for JUMP_ALIGN
+	int cc; // condition nibble, JUMP_ALWAYS for jmp, JUMP_ALIGN for padding
+	enum jump_form form;
+	idx_t len; // in the current layout
+} jump_site;
+
+static idx_t jump_len(const jump_site *j, enum jump_form form)
+{
+	switch (form) {
+	case JUMP_GONE: return 0;
+	case JUMP_SHORT: return 2;
+	case JUMP_NEAR: return j->cc == JUMP_ALWAYS? 5: 6;
+	}
+	__builtin_unreachable();
+}
+
+static idx_t placeholder_len(const jump_site *j)
+{
+	return j->cc == JUMP_ALIGN? 0: jump_len(j, JUMP_NEAR);
+}
+
+// where `at` ends up, shift[k] being how much the k first sites moved the code
+// the padding of a label goes before it, while a jump at the same offset goes after
+static idx_t relaxed_offset(const jump_site *js, const idx_t *shift, idx_t n, idx_t at)
+{
+	idx_t lo = 0, hi = n;
+	while (lo < hi) {
+		idx_t mid = lo + (hi - lo) / 2;
+		if (js[mid].offset < at || (js[mid].offset == at && js[mid].cc == JUMP_ALIGN)) lo = mid + 1;
+		else hi = mid;
+	}
+	return at + shift[lo];
+}
+
+static void jump_layout(jump_site *js, idx_t *shift, idx_t n)
+{
+	shift[0] = 0;
+	for (idx_t k = 0; k < n; k++) {
+		if (js[k].cc == JUMP_ALIGN) {
+			js[k].len = -(js[k].offset + shift[k]) & (js[k].label - 1);
+			// past 10 bytes of nops, settle for half the alignment
+			if (js[k].len > 10) js[k].len &= js[k].label / 2 - 1;
+		} else {
+			js[k].len = jump_len(&js[k], js[k].form);
+		}
+		shift[k+1] = shift[k] + js[k].len - placeholder_len(&js[k]);
+	}
+}
+
+static void relax_jumps(dyn_arr *ins, dyn_arr *jumps, const idx_t *labels, dyn_arr *refs, allocator *a)
+{
+	jump_site *js = jumps->buf.addr;
+	idx_t n = dyn_arr_size(jumps) / sizeof *js;
+	allocation m = ALLOC(a, (n + 1) * sizeof(idx_t), alignof(idx_t));
+	idx_t *shift = m.addr;
+	// every jump starts as small as it could ever be and only grows when it doesn't fit
+	// the jumps can only grow a bounded number of times, and the padding follows from them
+	for (idx_t k = 0; k < n; k++)
+		js[k].form = JUMP_GONE;
+	for (bool changed = true; changed; ) {
+		changed = false;
+		jump_layout(js, shift, n);
+		for (idx_t k = 0; k < n; k++) {
+			if (js[k].cc == JUMP_ALIGN) continue;
+			int64_t from = js[k].offset + shift[k];
+			int64_t to = relaxed_offset(js, shift, n, labels[js[k].label]);
+			bool fits = true;
+			if (js[k].form == JUMP_GONE)
+				fits = labels[js[k].label] > js[k].offset && to == from;
+			else if (js[k].form == JUMP_SHORT)
+				fits = to - (from + 2) >= INT8_MIN && to - (from + 2) <= INT8_MAX;
+			if (!fits) {
+				js[k].form++;
+				changed = true;
+			}
+		}
+	}
+
+	dyn_arr out;
+	dyn_arr_init(&out, dyn_arr_size(ins) + shift[n], a);
+	byte *code = ins->buf.addr;
+	idx_t copied = 0;
+	for (idx_t k = 0; k < n; k++) {
+		dyn_arr_push(&out, code + copied, js[k].offset - copied, a);
+		copied = js[k].offset + placeholder_len(&js[k]);
+		byte buf[16], *p = buf;
+		if (js[k].cc == JUMP_ALIGN) {
+			p = nops(p, js[k].len);
+		} else if (js[k].form == JUMP_SHORT) {
+			int32_t rel = relaxed_offset(js, shift, n, labels[js[k].label]) - (js[k].offset + shift[k] + 2);
+			*p++ = js[k].cc == JUMP_ALWAYS? 0xeb: 0x70 | js[k].cc;
+			p = emit_imm(p, rel, 1);
+		} else if (js[k].form == JUMP_NEAR) {
+			int32_t rel = relaxed_offset(js, shift, n, labels[js[k].label]) - (js[k].offset + shift[k] + js[k].len);
+			if (js[k].cc == JUMP_ALWAYS) {
+				*p++ = 0xe9;
+			} else {
+				*p++ = 0x0f;
+				*p++ = 0x80 | js[k].cc;
+			}
+			p = emit_imm(p, rel, 4);
+		}
+		dyn_arr_push(&out, buf, p - buf, a);
+	}
+	dyn_arr_push(&out, code + copied, dyn_arr_size(ins) - copied, a);
+	for (gen_reloc *r = refs->buf.addr, *end = refs->end; r != end; r++)
+		r->offset = relaxed_offset(js, shift, n, r->offset);
+	DEALLOC(a, m);
+	dyn_arr_fini(ins, a);
+	*ins = out;
+}
+
 static idx_t gen_symbol(gen_sym *dst, ir3_func *src, allocator *a, idx_t *renum, type_layout *types)
 {
-	dyn_arr ins, refs, label_relocs;
+	dyn_arr ins, refs, jumps;
 	dyn_arr_init(&ins, 0, a);
 	dyn_arr_init(&refs, 0, a);
-	dyn_arr_init(&label_relocs, 0*sizeof(gen_reloc), a);
+	dyn_arr_init(&jumps, 0*sizeof(jump_site), a);
 
 	allocation temp_alloc = ALLOC(a, src->num_labels * sizeof(idx_t), 4);
 	idx_t *labels = temp_alloc.addr;
-	// TODO: use the layout structure
 	type frame;
 	type_layout layt = gen_layout(&src->locals, &frame, a);
+	idx_t n = dyn_arr_size(&src->locals) / sizeof(type*);
+	allocation m_regs = ALLOC(a, n + 1, 1);
+	frame_info fr = { .fields=layt.fields, .regs=m_regs.addr };
+	regalloc(&fr, src, a);
+	// an address read once, right after being computed, folds into that load or store
+	// a zero that is only compared against is never materialized, the comparisons test instead
+	allocation m_uses = ALLOC(a, (n + 1) * (3*sizeof(idx_t) + sizeof(bool)), alignof(idx_t));
+	idx_t *uses = m_uses.addr, *defs = uses + n, *tested = defs + n;
+	bool *zero = (bool*) (tested + n);
+	memset(uses, 0, n * (3*sizeof(idx_t) + sizeof(bool)));
+	bool leaf = true, escapes = false;
+	allocation m_lbl = ALLOC(a, (src->num_labels + 1) * sizeof(ssa_instr*), alignof(ssa_instr*));
+	ssa_instr **lbl_at = m_lbl.addr;
+	for (ssa_instr *i = src->ins.buf.addr; i != src->ins.end; i += 1 + ssa_ext_len(i)) {
+		leaf &= i->kind != SSA_CALL;
+		escapes |= i->kind == SSA_ADDRESS;
+		if (i->kind == SSA_LABEL) lbl_at[i->to] = i;
+		ssa_ref *use_end, *use = ssa_uses(i, &use_end);
+		for (; use != use_end; use++)
+			uses[*use]++;
+		ssa_ref def = ssa_def(i);
+		if (def == REF_NONE) continue;
+		defs[def]++;
+		zero[def] = (i->kind == SSA_BOOL && i->L == 0) || (i->kind == SSA_IMM && i[1].v == 0);
+	}
+	for (idx_t v = 0; v < n; v++)
+		zero[v] &= defs[v] == 1;
+	for (ssa_instr *i = src->ins.buf.addr; i != src->ins.end; i += 1 + ssa_ext_len(i))
+		if ((i->kind == SSA_BR || i->kind == SSA_SET) && zero[i->R])
+			tested[i->R]++;
+	// only the locals that did not get a register take room in the frame
+	type **ltypes = src->locals.buf.addr;
+	idx_t locals_size = 0;
+	for (idx_t v = 0; v < n; v++) {
+		if (fr.regs[v] != NO_REG) continue;
+		assert(ltypes[v]->align <= 16);
+		locals_size = ALIGN(locals_size, ltypes[v]->align);
+		layt.fields[v].offset = locals_size;
+		locals_size += layt.fields[v].size;
+	}
+	// the call pushed 8 bytes onto a 16-aligned rsp, and so does every saved register:
+	// the frame is sized so that the locals start 16-aligned, which is also what the calls want
+	int pushed = 1 + __builtin_popcount(fr.saved);
+	fr.size = ALIGN(locals_size, 16) + (pushed % 2) * 8;
+	// a leaf can keep its locals below rsp, nothing will write there behind its back
+	if (leaf && fr.size <= 128) {
+		for (idx_t v = 0; v < n; v++)
+			if (fr.regs[v] == NO_REG) layt.fields[v].offset -= fr.size;
+		fr.size = 0;
+	}
 
-	byte buf[64], *p = buf;
+	byte buf[256], *p = buf;
 	// p = endbr64(p);
-	p = push64(p, RBP);
-	assert(frame.align <= 16);
-	p = addsubimm(p, RSP, frame.size, SSA_SUB, 8);
-	p = mov(p, RBP, RSP, 8);
+	for (int r = 0; r <= R15; r++)
+		if (fr.saved & REG_BIT(r)) p = push64(p, r);
+	if (fr.size) p = addsubimm(p, RSP, fr.size, SSA_SUB, 8);
 	dyn_arr_push(&ins, buf, p-buf, a);
+	bool reachable = true;
 	for (ssa_instr *start = src->ins.buf.addr, *end = src->ins.end,
 			*i = start; i != end; i++) {
 		p = buf;
+		if (i->kind == SSA_LABEL) reachable = true;
+		if (!reachable) {
+			i += ssa_ext_len(i);
+			continue;
+		}
 		switch (i->kind) {
 			int width;
+			enum x86_64_reg L, R, to;
 			case SSA_GOTO:
+				dyn_arr_push(&jumps, &(jump_site){ .offset=dyn_arr_size(&ins), .label=i->to, .cc=JUMP_ALWAYS }, sizeof(jump_site), a);
 				*p++ = 0xe9;
-				dyn_arr_push(&label_relocs, &(gen_reloc){ .offset=dyn_arr_size(&ins) + 1, .symref=i->to }, sizeof(gen_reloc), a);
 				p = emit_imm(p, 0, 4);
+				reachable = false;
 				break;
 
 			case SSA_SET:
-				width = layt.fields[i->L].size;
-				p = load_rbprel(p, RAX, layt.fields[i->L].offset, width);
-				p = load_rbprel(p, RCX, layt.fields[i->R].offset, width);
-				p = cmp(p, RAX, RCX, width);
-				p = setcc_mem(p, layt.fields[i->to].offset, i[1].to);
+				p = compare(p, &fr, i->L, i->R, zero[i->R], layt.fields[i->L].size);
+				if (fr.regs[i->to] == NO_REG)
+					p = setcc_mem(p, layt.fields[i->to].offset, i[1].to);
+				else
+					p = setcc(p, fr.regs[i->to], i[1].to);
 				i++;
 				break;
 
 			case SSA_BR:
-				width = layt.fields[i->L].size;
-				p = load_rbprel(p, RAX, layt.fields[i->L].offset, width);
-				p = load_rbprel(p, RCX, layt.fields[i->R].offset, width);
-				p = cmp(p, RAX, RCX, width);
-				*p++ = 0x0f;
-				*p++ = 0x80 | bc2cc[i->to];
 				{
-				idx_t offset = dyn_arr_size(&ins) + p - buf;
-				dyn_arr_push(&label_relocs, &(gen_reloc){ offset, i[1].L }, sizeof(gen_reloc), a);
+				p = compare(p, &fr, i->L, i->R, zero[i->R], layt.fields[i->L].size);
+				// `jcc then; jmp else; then:` is a single `jncc else`
+				ssa_instr *jmp = i + 2;
+				jump_site j = { .offset=dyn_arr_size(&ins) + p - buf, .label=i[1].L, .cc=bc2cc[i->to] };
+				if (jmp + 1 < end && jmp->kind == SSA_GOTO && jmp[1].kind == SSA_LABEL && jmp[1].to == i[1].L) {
+					j.label = jmp->to;
+					j.cc ^= 1;
+					i = jmp;
+					reachable = false;
+				} else {
+					i++;
 				}
+				dyn_arr_push(&jumps, &j, sizeof j, a);
+				*p++ = 0x0f;
+				*p++ = 0x80 | j.cc;
 				p = emit_imm(p, 0, 4);
-				i++;
 				break;
+				}
 
 			case SSA_COPY:
-				width = layt.fields[i->L].size;
-				p = load_rbprel(p, RAX, layt.fields[i->L].offset, width);
-				p = store_rbprel(p, RAX, layt.fields[i->to].offset, layt.fields[i->to].size);
+				to = home(&fr, i->to, SCRATCH0);
+				p = fetch(p, &fr, to, i->L);
+				p = commit(p, &fr, i->to, to);
 				break;
 
 			case SSA_CONVERT:
-				width = layt.fields[i->L].size;
-				p = load_rbprel(p, RAX, layt.fields[i->L].offset, width);
-				p = convert(p, i->R);
-				p = store_rbprel(p, RAX, layt.fields[i->to].offset, layt.fields[i->to].size);
+				p = fetch(p, &fr, L = home(&fr, i->L, SCRATCH0), i->L);
+				to = home(&fr, i->to, SCRATCH0);
+				p = convert(p, i->R, to, L);
+				p = commit(p, &fr, i->to, to);
 				break;
 
 			case SSA_LABEL:
 				labels[i->to] = dyn_arr_size(&ins);
+				if (i->L) dyn_arr_push(&jumps, &(jump_site){ .offset=labels[i->to], .label=i->L, .cc=JUMP_ALIGN }, sizeof(jump_site), a);
 				break;
 
 			case SSA_BOOL:
-				p = store_rbprel_imm8(p, layt.fields[i->to].offset, i->L);
+				if (zero[i->to] && tested[i->to] == uses[i->to]) break;
+				if (fr.regs[i->to] == NO_REG)
+					p = store_rsprel_imm8(p, layt.fields[i->to].offset, i->L);
+				else
+					p = mov_imm(p, fr.regs[i->to], i->L, 1);
 				break;
 
 			case SSA_BOOL_NEG:
 				width = layt.fields[i->L].size;
-				p = load_rbprel(p, RDX, layt.fields[i->L].offset, width);
-				p = test(p, RDX, RDX, width);
-				p = setcc_mem(p, layt.fields[i->to].offset, SSAB_EQ); // test dl, dl gives ZF iff dl == 0
+				p = fetch(p, &fr, L = home(&fr, i->L, SCRATCH0), i->L);
+				p = test(p, L, L, width);
+				// test dl, dl gives ZF iff dl == 0
+				if (fr.regs[i->to] == NO_REG)
+					p = setcc_mem(p, layt.fields[i->to].offset, SSAB_EQ);
+				else
+					p = setcc(p, fr.regs[i->to], SSAB_EQ);
 				break;
 
 			case SSA_IMM:
+				if (zero[i->to] && tested[i->to] == uses[i->to]) {
+					i++;
+					break;
+				}
 				width = layt.fields[i->to].size;
-				p = mov_imm(p, RAX, i[1].v, width);
-				p = store_rbprel(p, RAX, layt.fields[i->to].offset, width);
+				p = mov_imm(p, to = home(&fr, i->to, SCRATCH0), i[1].v, width);
+				p = commit(p, &fr, i->to, to);
 				i++; // because of the extension
 				break;
-				
-			case SSA_ADD: case SSA_SUB:
-				width = layt.fields[i->to].size;
-				p = load_rbprel(p, RAX, layt.fields[i->to].offset, width);
-				p = load_rbprel(p, RDX, layt.fields[i->R ].offset, width);
-				p = addsub(p, RAX, RDX, i->kind, width);
-				p = store_rbprel(p, RAX, layt.fields[i->to].offset, width);
-				break;
 
-			case SSA_MUL:
+			case SSA_ADD: case SSA_SUB: case SSA_MUL:
 				width = layt.fields[i->to].size;
-				p = load_rbprel(p, RAX, layt.fields[i->to].offset, width);
-				p = load_rbprel(p, RCX, layt.fields[i->R ].offset, width);
-				p = umul(p, RCX, width);
-				p = store_rbprel(p, RAX, layt.fields[i->to].offset, width);
+				p = fetch(p, &fr, to = home(&fr, i->to, SCRATCH0), i->to);
+				p = fetch(p, &fr, R = home(&fr, i->R, SCRATCH1), i->R);
+				if (i->kind == SSA_MUL)
+					p = imul(p, to, R, width);
+				else
+					p = addsub(p, to, R, i->kind, width);
+				p = commit(p, &fr, i->to, to);
 				break;
 
 			case SSA_MEMCOPY:
 				width = layt.fields[i->to].size;
-				// slow and dirty repne movsb
-				p = lea(p, RDI, RBP, layt.fields[i->to].offset, 8); // assuming pointers are 8-bytes
-				p = load_rbprel(p, RSI, layt.fields[i->L].offset, 8);
+				if (width <= INLINE_COPY_MAX) {
+					p = fetch(p, &fr, L = home(&fr, i->L, SCRATCH1), i->L);
+					p = copy_inline(p, RSP, layt.fields[i->to].offset, L, width);
+					break;
+				}
+				// past that, rep movsb is as fast as it gets on anything with ERMSB
+				// the source first: it may be sitting in rdi
+				p = fetch(p, &fr, RSI, i->L);
+				p = lea(p, RDI, RSP, layt.fields[i->to].offset, 8); // assuming pointers are 8-bytes
 				p = mov_imm(p, RCX, width, 8);
-				*p++ = 0xf2;
+				*p++ = 0xf3;
 				*p++ = 0xa4;
 				break;
 
 			case SSA_ADDRESS:
 				width = layt.fields[i->to].size;
 				assert(width == 8);
-				p = lea(p, RAX, RBP, layt.fields[i->L].offset, width);
-				p = store_rbprel(p, RAX, layt.fields[i->to].offset, width);
+				p = lea(p, to = home(&fr, i->to, SCRATCH0), RSP, layt.fields[i->L].offset, width);
+				p = commit(p, &fr, i->to, to);
 				break;
 
 			case SSA_LOAD:
 				width = layt.fields[i->to].size;
-				p = load_rbprel(p, RAX, layt.fields[i->L].offset, 8);
-				p = load(p, RSI, RAX, 0, width);
-				p = store_rbprel(p, RSI, layt.fields[i->to].offset, width);
+				p = fetch(p, &fr, L = home(&fr, i->L, SCRATCH0), i->L);
+				p = load(p, to = home(&fr, i->to, SCRATCH1), L, 0, width);
+				p = commit(p, &fr, i->to, to);
 				break;
 
 			case SSA_STORE: // .to -> .L
 				width = layt.fields[i->to].size;
-				p = load_rbprel(p, RAX, layt.fields[i->to].offset, width);
-				p = load_rbprel(p, RSI, layt.fields[i->L].offset, 8);
-				p = store(p, RAX, RSI, 0, width);
+				p = fetch(p, &fr, to = home(&fr, i->to, SCRATCH0), i->to);
+				p = fetch(p, &fr, L = home(&fr, i->L, SCRATCH1), i->L);
+				p = store(p, to, L, 0, width);
 				break;
 
 			case SSA_CALL:
 				{
-				assert(i->R < 6);
-				idx_t ratio = sizeof(ssa_extension) / sizeof(ssa_ref);
-				idx_t num_ext = (i->R + ratio - 1) / ratio + 1;
-				// little endian things
+				assert(i->R <= 6);
+				ssa_ref *args = (ssa_ref*) &i[2];
+				enum x86_64_reg move_dst[6], move_src[6];
+				int moves = 0;
 				for (ssa_ref arg = 0; arg < i->R; arg++) {
-					ssa_extension ext = i[2 + arg/ratio].v;
-					idx_t shift = 8 * (arg % ratio);
-					ssa_ref id = (ext >> shift) & ((1L << (8 * sizeof id)) - 1);
-					p = load_rbprel(p, sysv_arg[arg], layt.fields[id].offset, layt.fields[id].size);
+					if (fr.regs[args[arg]] == NO_REG) continue;
+					move_dst[moves] = sysv_arg[arg];
+					move_src[moves++] = fr.regs[args[arg]];
 				}
-				*p++ = 0xe8;
+				p = parallel_move(p, move_dst, move_src, moves);
+				// the stack ones last, as they don't read any register
+				for (ssa_ref arg = 0; arg < i->R; arg++)
+					if (fr.regs[args[arg]] == NO_REG)
+						p = fetch(p, &fr, sysv_arg[arg], args[arg]);
+				// a call whose result is returned as is can leave with the frame gone and jump instead,
+				// unless the address of a local may have been handed to the callee
+				bool tail = !escapes && in_tail_position(i, end, lbl_at);
+				if (tail) p = teardown(p, &fr);
+				*p++ = tail? 0xe9: 0xe8;
 				idx_t offset = dyn_arr_size(&ins) + p - buf;
 				gen_reloc r = { offset, i[1].v };
 				dyn_arr_push(&refs, &r, sizeof r, a);
 				p = emit_imm(p, 0, 4);
-				p = store_rbprel(p, RAX, layt.fields[i->to].offset, layt.fields[i->to].size);
-				i += num_ext;
+				if (tail) reachable = false;
+				else p = commit(p, &fr, i->to, RAX);
+				i += ssa_ext_len(i);
 				}
 				break;
 
@@ -489,36 +1178,96 @@ static idx_t gen_symbol(gen_sym *dst, ir3_func *src, allocator *a, idx_t *renum,
 				{
 				width = layt.fields[i->to].size;
 				assert(width == 8);
-				p = lea_rip(p, RAX, 0, width);
+				p = lea_rip(p, to = home(&fr, i->to, SCRATCH0), 0, width);
 				idx_t offset = dyn_arr_size(&ins) + p - buf - 4;
 				gen_reloc r = { offset, i[1].v };
 				dyn_arr_push(&refs, &r, sizeof r, a);
-				p = store_rbprel(p, RAX, layt.fields[i->to].offset, width);
+				p = commit(p, &fr, i->to, to);
 				i++;
 				break;
 				}
 
 			case SSA_RET:
-				width = layt.fields[i->to].size;
-				p = load_rbprel(p, RAX, layt.fields[i->to].offset, width);
-				p = addsubimm(p, RSP, frame.size, SSA_ADD, 8);
-				p = pop64(p, RBP);
-				*p++ = 0xc3;
+				p = fetch(p, &fr, RAX, i->to);
+				p = epilogue(p, &fr);
+				reachable = false;
 				break;
 
 			case SSA_ARG:
-				assert(i->L < 6);
+				{
+				// all the arguments are moved out of their registers at once,
+				// otherwise one of them could be overwritten before it is read
+				enum x86_64_reg move_dst[6], move_src[6];
+				int moves = 0;
+				for (; i != end && i->kind == SSA_ARG; i++) {
+					assert(i->L < 6);
+					// sysV abi: int registers rdi>rsi>rdx>rcx>r8>r9
+					if (fr.regs[i->to] == NO_REG) {
+						p = store_rsprel(p, sysv_arg[i->L], layt.fields[i->to].offset, layt.fields[i->to].size);
+					} else {
+						move_dst[moves] = fr.regs[i->to];
+						move_src[moves++] = sysv_arg[i->L];
+					}
+				}
+				p = parallel_move(p, move_dst, move_src, moves);
+				i--;
+				break;
+				}
+
+			case SSA_MULI:
 				width = layt.fields[i->to].size;
-				// sysV abi: int registers rdi>rsi>rdx>rcx>r8>r9
-				p = store_rbprel(p, sysv_arg[i->L], layt.fields[i->to].offset, width);
+				p = fetch(p, &fr, L = home(&fr, i->L, SCRATCH0), i->L);
+				p = muli(p, to = home(&fr, i->to, SCRATCH0), L, i[1].v, width);
+				p = commit(p, &fr, i->to, to);
+				i++;
 				break;
 
+			case SSA_LEA:
+				{
+				width = layt.fields[i->to].size < 8? 4: 8;
+				x86_mem mem = { .scale=i[1].L, .disp=(int32_t) i[1].R };
+				ssa_instr *next = i + 2;
+				bool fold = next != end && uses[i->to] == 1 && next->L == i->to
+					&& (next->kind == SSA_LOAD || (next->kind == SSA_STORE && next->to != i->to));
+				// the spilled operands each need one of the two scratch registers
+				enum x86_64_reg scratch[2] = { SCRATCH0, SCRATCH1 };
+				int spilled = 0;
+				ssa_ref operands[3] = { i->L, mem.scale? i->R: REF_NONE, fold && next->kind == SSA_STORE? next->to: REF_NONE };
+				enum x86_64_reg regs[3];
+				for (int k = 0; k < 3; k++) {
+					if (operands[k] == REF_NONE) continue;
+					if (fr.regs[operands[k]] != NO_REG) regs[k] = fr.regs[operands[k]];
+					else if (spilled < 2) regs[k] = scratch[spilled++];
+					else fold = false;
+				}
+				p = fetch(p, &fr, mem.base = regs[0], i->L);
+				if (mem.scale) p = fetch(p, &fr, mem.index = regs[1], i->R);
+				if (fold && next->kind == SSA_LOAD) {
+					p = load_mem(p, to = home(&fr, next->to, SCRATCH0), &mem, layt.fields[next->to].size);
+					p = commit(p, &fr, next->to, to);
+					i = next;
+				} else if (fold) {
+					p = fetch(p, &fr, regs[2], next->to);
+					p = store_mem(p, regs[2], &mem, layt.fields[next->to].size);
+					i = next;
+				} else {
+					to = home(&fr, i->to, SCRATCH0);
+					if (!mem.scale && to == mem.base)
+						p = addsubimm(p, to, mem.disp, SSA_ADD, width);
+					else
+						p = lea_mem(p, to, &mem, width);
+					p = commit(p, &fr, i->to, to);
+					i++;
+				}
+				break;
+				}
+
 			case SSA_OFFSETOF:
 				{
 				field_info *field = &types[renum[i->L]].fields[i->R];
 				width = layt.fields[i->to].size;
-				p = mov_imm(p, RAX, field->offset, width);
-				p = store_rbprel(p, RAX, layt.fields[i->to].offset, width);
+				p = mov_imm(p, to = home(&fr, i->to, SCRATCH0), field->offset, width);
+				p = commit(p, &fr, i->to, to);
 				break;
 				}
 
@@ -529,14 +1278,14 @@ static idx_t gen_symbol(gen_sym *dst, ir3_func *src, allocator *a, idx_t *renum,
 		dyn_arr_push(&ins, buf, p - buf, a);
 	}
 
-	byte *base = ins.buf.addr;
-	for (gen_reloc *reloc = label_relocs.buf.addr, *end = label_relocs.end;
-			reloc != end; reloc++) {
-		uint32_t rel = labels[reloc->symref] - reloc->offset - 4;
-		memcpy(base + reloc->offset, &rel, sizeof rel);
-	}
-	
-	dyn_arr_fini(&label_relocs, a);
+	relax_jumps(&ins, &jumps, labels, &refs, a);
+	dyn_arr_fini(&jumps, a);
+	// every function starts 16-aligned, or the alignment of its labels would mean nothing
+	idx_t tail = -dyn_arr_size(&ins) & 15;
+	memset(dyn_arr_push(&ins, NULL, tail, a), 0xcc, tail);
+	DEALLOC(a, m_lbl);
+	DEALLOC(a, m_uses);
+	DEALLOC(a, m_regs);
 	DEALLOC(a, temp_alloc);
 	DEALLOC(a, (allocation){ layt.fields, layt.alloc_size });
 	dst->ins = scratch_from(&ins, a, a);
@@ -544,23 +1293,79 @@ static idx_t gen_symbol(gen_sym *dst, ir3_func *src, allocator *a, idx_t *renum,
 	return scratch_len(dst->ins);
 }
 
-gen_module gen_x86_64(ir3_module m2ac, allocator *a)
+// the functions end up one after the other in .text, so a call or a lea from a function to another
+// has its displacement known now; only the references to .rodata are left for the linker
+static idx_t resolve_local_refs(gen_module *mod, allocator *a)
+{
+	gen_sym *syms = scratch_start(mod->syms);
+	idx_t num_syms = scratch_len(mod->syms) / sizeof *syms;
+	idx_t *renum = scratch_start(mod->renum);
+	allocation m = ALLOC(a, (num_syms ? num_syms : 1) * sizeof(idx_t), alignof(idx_t));
+	idx_t *text_offset = m.addr;
+	for (idx_t i = 0, offset = 0; i < num_syms; i++) {
+		if (syms[i].kind != GEN_CODE) continue;
+		text_offset[i] = offset;
+		offset += scratch_len(syms[i].ins);
+	}
+	idx_t num_refs = 0;
+	for (idx_t i = 0; i < num_syms; i++) {
+		if (syms[i].kind != GEN_CODE) continue;
+		dyn_arr left;
+		dyn_arr_init(&left, 0, a);
+		byte *ins = scratch_start(syms[i].ins);
+		for (gen_reloc *r = scratch_start(syms[i].refs), *end = scratch_end(syms[i].refs); r != end; r++) {
+			idx_t target = renum[r->symref] - 1;
+			if (syms[target].kind != GEN_CODE) {
+				dyn_arr_push(&left, r, sizeof *r, a);
+				continue;
+			}
+			// the disp32 is relative to the end of the instruction, which it ends
+			int32_t disp = text_offset[target] - (text_offset[i] + r->offset + 4);
+			memcpy(ins + r->offset, &disp, sizeof disp);
+		}
+		scratch_fini(syms[i].refs, a);
+		syms[i].refs = scratch_from(&left, a, a);
+		num_refs += scratch_len(syms[i].refs) / sizeof(gen_reloc);
+	}
+	DEALLOC(a, m);
+	return num_refs;
+}
+
+typedef struct gen_job {
+	gen_sym *syms;
+	ir3_func **funcs; // [index in syms], NULL for the rodata
+	idx_t *renum;
+	type_layout *layouts;
+	allocator *a;
+} gen_job;
+
+static void gen_one(void *ctx, size_t i, MAYBE_UNUSED int worker)
+{
+	gen_job *job = ctx;
+	if (job->funcs[i])
+		gen_symbol(&job->syms[i], job->funcs[i], job->a, job->renum, job->layouts);
+}
+
+gen_module gen_x86_64(ir3_module m2ac, int jobs, allocator *a)
 {
 	gen_module out;
 	out.code_size = 0;
 	out.num_refs = 0;
-	dyn_arr dest, refs, rodata, renum, layouts;
+	dyn_arr dest, funcs, rodata, renum, layouts;
 	dyn_arr_init(&dest, 0*sizeof(gen_sym), a);
-	dyn_arr_init(&refs, 0*sizeof(gen_reloc), a);
+	dyn_arr_init(&funcs, 0*sizeof(ir3_func*), a);
 	dyn_arr_init(&renum, 0*sizeof(idx_t), a);
 	dyn_arr_init(&layouts, 0*sizeof(type_layout), a);
 	dyn_arr_init(&rodata, 0, a);
+	// the symbols are numbered and the data laid out first, so that every function body
+	// can then be encoded on its own, only reading `renum` and `layouts`
 	idx_t objsym = 1;
 	for (ir3_sym *prev = scratch_start(m2ac), *end = scratch_end(m2ac);
 			prev != end; prev++) {
 		idx_t *idx = dyn_arr_push(&renum, NULL, sizeof *idx, a);
 		if (prev->kind == IR3_BLOB) {
 			gen_sym *new = dyn_arr_push(&dest, NULL, sizeof *new, a);
+			dyn_arr_push(&funcs, &(ir3_func*){ NULL }, sizeof(ir3_func*), a);
 			idx_t at = dyn_arr_size(&rodata);
 			idx_t aligned = (at + prev->align - 1) / prev->align * prev->align;
 			idx_t padding = aligned - at;
@@ -572,9 +1377,8 @@ gen_module gen_x86_64(ir3_module m2ac, allocator *a)
 			*idx = objsym++;
 		} else if (prev->kind == IR3_FUNC) {
 			gen_sym *new = dyn_arr_push(&dest, NULL, sizeof *new, a);
+			dyn_arr_push(&funcs, &(ir3_func*){ &prev->f }, sizeof(ir3_func*), a);
 			new->kind = GEN_CODE;
-			out.code_size += gen_symbol(new, &prev->f, a, renum.buf.addr, layouts.buf.addr);
-			out.num_refs  += scratch_len(new->refs) / sizeof(gen_reloc);
 			*idx = objsym++;
 		} else if (prev->kind == IR3_AGGREG) {
 			type_layout l = gen_layout(&prev->fields, prev->back, a);
@@ -583,10 +1387,18 @@ gen_module gen_x86_64(ir3_module m2ac, allocator *a)
 		} else
 			__builtin_unreachable();
 	}
+	// each body only writes its own gen_sym, the module comes out the same whatever the number of jobs
+	gen_job job = { dest.buf.addr, funcs.buf.addr, renum.buf.addr, layouts.buf.addr, a };
+	parallel_for(dyn_arr_size(&funcs) / sizeof(ir3_func*), jobs, gen_one, &job);
+	for (gen_sym *sym = dest.buf.addr; sym != dest.end; sym++)
+		if (sym->kind == GEN_CODE)
+			out.code_size += scratch_len(sym->ins);
+	dyn_arr_fini(&funcs, a);
 	out.syms = scratch_from(&dest, a, a);
 	out.rodata = scratch_from(&rodata, a, a);
 	out.renum = scratch_from(&renum, a, a);
 	out.layouts = scratch_from(&layouts, a, a);
+	out.num_refs = resolve_local_refs(&out, a);
 	return out;
 }
 
@@ -0,0 +1,959 @@
+#include "opt.h"
+#include "ssa.h"
+#include "3ac.h"
+#include "ast.h"
+#include "alloc.h"
+#include "dynarr.h"
+#include "map.h"
+
+#include <string.h>
+#include <assert.h>
+#include <stdbool.h>
+
+static ssa_instr *instr_at(const ir3_func *f, idx_t offset)
+{
+	return f->ins.buf.addr + offset;
+}
+
+static ssa_instr *next_instr(ssa_instr *i)
+{
+	return i + 1 + ssa_ext_len(i);
+}
+
+static type *local_type(const ir3_func *f, ssa_ref r)
+{
+	return ((type**) f->locals.buf.addr)[r];
+}
+
+// values are kept sign-extended from the width of their type, like the registers they end up in
+static int64_t truncate(uint64_t v, uint64_t size)
+{
+	if (size >= 8) return v;
+	int shift = 64 - 8 * size;
+	return (int64_t) (v << shift) >> shift;
+}
+
+typedef struct lattice {
+	enum { LAT_TOP, LAT_CONST, LAT_BOTTOM } kind;
+	int64_t v;
+} lattice;
+
+static lattice meet(lattice l, lattice r)
+{
+	if (l.kind == LAT_TOP) return r;
+	if (r.kind == LAT_TOP) return l;
+	if (l.kind == LAT_BOTTOM || r.kind == LAT_BOTTOM || l.v != r.v)
+		return (lattice){ .kind=LAT_BOTTOM };
+	return l;
+}
+
+static bool compare(enum ssa_branch_cc cc, int64_t L, int64_t R)
+{
+	switch (cc) {
+	case SSAB_EQ: return L == R;
+	case SSAB_NE: return L != R;
+	case SSAB_LT: return L <  R;
+	case SSAB_LE: return L <= R;
+	case SSAB_GT: return L >  R;
+	case SSAB_GE: return L >= R;
+	default: __builtin_unreachable();
+	}
+}
+
+// the operands that are not constants yet decide for the result
+#define BOTH_CONST(lat, i) \
+	((lat)[(i)->L].kind == LAT_CONST && (lat)[(i)->R].kind == LAT_CONST)
+#define NOT_CONST(lat, i) \
+	((lattice){ .kind=(lat)[(i)->L].kind == LAT_BOTTOM || (lat)[(i)->R].kind == LAT_BOTTOM? LAT_BOTTOM: LAT_TOP })
+
+static lattice sccp_eval(const ir3_func *f, const ssa_instr *i, const lattice *lat)
+{
+	uint64_t size = local_type(f, i->to)->size;
+	switch (i->kind) {
+	case SSA_IMM:
+		return (lattice){ LAT_CONST, truncate(i[1].v, size) };
+	case SSA_BOOL:
+		return (lattice){ LAT_CONST, i->L != 0 };
+	case SSA_COPY:
+		return lat[i->L];
+	case SSA_CONVERT:
+		if (lat[i->L].kind != LAT_CONST) return lat[i->L];
+		if (local_type(f, i->to)->kind == TYPE_BOOL)
+			return (lattice){ LAT_CONST, lat[i->L].v != 0 };
+		return (lattice){ LAT_CONST, truncate(lat[i->L].v, size) };
+	case SSA_BOOL_NEG:
+		if (lat[i->L].kind != LAT_CONST) return lat[i->L];
+		return (lattice){ LAT_CONST, lat[i->L].v == 0 };
+	case SSA_ADD:
+	case SSA_SUB:
+	case SSA_MUL:
+		{
+		if (!BOTH_CONST(lat, i)) return NOT_CONST(lat, i);
+		uint64_t L = lat[i->L].v, R = lat[i->R].v;
+		uint64_t v = i->kind == SSA_ADD? L + R: i->kind == SSA_SUB? L - R: L * R;
+		return (lattice){ LAT_CONST, truncate(v, size) };
+		}
+	case SSA_SET:
+		if (!BOTH_CONST(lat, i)) return NOT_CONST(lat, i);
+		return (lattice){ LAT_CONST, compare(i[1].to, lat[i->L].v, lat[i->R].v) };
+	default:
+		// loads, calls, arguments, addresses...
+		return (lattice){ .kind=LAT_BOTTOM };
+	}
+}
+
+static bool edge_executable(const ir3_cfg *cfg, bool (*exec_edge)[2], ssa_ref from, ssa_ref to)
+{
+	return exec_edge[from][cfg->succ[from][0] == to? 0: 1];
+}
+
+static ssa_ref phi_entries(const ir3_cfg *cfg, bool (*exec_edge)[2], const ssa_instr *phi, ssa_ref b)
+{
+	const ssa_ref *labels = (ssa_ref*) &phi[1];
+	ssa_ref num = 0;
+	for (ssa_ref j = 0; j < phi->R; j++)
+		num += edge_executable(cfg, exec_edge, labels[j], b);
+	return num;
+}
+
+static bool mark(bool *flag)
+{
+	bool was = *flag;
+	*flag = true;
+	return !was;
+}
+
+void opt_sccp(ir3_func *f, allocator *a)
+{
+	ir3_cfg cfg;
+	cfg_init(&cfg, f, a);
+	idx_t n = cfg.num_blocks, nv = dyn_arr_size(&f->locals) / sizeof(type*);
+	const ir3_node *nodes = f->nodes.buf.addr;
+	allocation ml = ALLOC(a, nv * sizeof(lattice), alignof(lattice));
+	lattice *lat = ml.addr;
+	allocation mb = ALLOC(a, 3 * n * sizeof(bool), alignof(bool));
+	bool *exec_block = mb.addr, (*exec_edge)[2] = (void*) (exec_block + n);
+	memset(mb.addr, 0, 3 * n * sizeof(bool));
+
+	// a local that is never defined holds whatever was there: not a constant
+	// neither is one that lives in memory, as stores through its address can change it
+	for (idx_t v = 0; v < nv; v++)
+		lat[v] = (lattice){ .kind=LAT_BOTTOM };
+	for (idx_t k = 0; k < cfg.num_reachable; k++) {
+		ssa_ref b = cfg.rpo[k];
+		for (ssa_instr *i = instr_at(f, nodes[b].begin), *end = instr_at(f, cfg.ends[b]); i != end; i = next_instr(i)) {
+			ssa_ref def = ssa_def(i);
+			if (def != REF_NONE) lat[def] = (lattice){ .kind=LAT_TOP };
+		}
+	}
+	for (idx_t k = 0; k < cfg.num_reachable; k++) {
+		ssa_ref b = cfg.rpo[k];
+		for (ssa_instr *i = instr_at(f, nodes[b].begin), *end = instr_at(f, cfg.ends[b]); i != end; i = next_instr(i))
+			if (i->kind == SSA_ADDRESS)
+				lat[i->L] = (lattice){ .kind=LAT_BOTTOM };
+	}
+
+	// the lattice is 3 levels high, so iterating in reverse postorder converges quickly enough
+	if (n) exec_block[0] = true;
+	for (bool changed = true; changed; ) {
+		changed = false;
+		for (idx_t k = 0; k < cfg.num_reachable; k++) {
+			ssa_ref b = cfg.rpo[k];
+			if (!exec_block[b]) continue;
+			ssa_instr *i = instr_at(f, nodes[b].begin), *end = instr_at(f, cfg.ends[b]);
+			bool terminated = false;
+			for (; i != end; i = next_instr(i)) {
+				if (i->kind == SSA_BR) {
+					terminated = true;
+					lattice L = lat[i->L], R = lat[i->R];
+					if (L.kind == LAT_TOP || R.kind == LAT_TOP) continue;
+					bool known = L.kind == LAT_CONST && R.kind == LAT_CONST, taken = known && compare(i->to, L.v, R.v);
+					for (int s = 0; s < 2; s++) if (!known || taken == (s == 0)) {
+						changed |= mark(&exec_edge[b][s]);
+						changed |= mark(&exec_block[cfg.succ[b][s]]);
+					}
+					continue;
+				}
+				if (i->kind == SSA_GOTO || i->kind == SSA_RET) {
+					terminated = true;
+					if (i->kind == SSA_GOTO) {
+						changed |= mark(&exec_edge[b][0]);
+						changed |= mark(&exec_block[cfg.succ[b][0]]);
+					}
+					continue;
+				}
+				ssa_ref def = ssa_def(i);
+				if (def == REF_NONE) continue;
+				lattice v;
+				if (i->kind == SSA_PHI) {
+					v = (lattice){ .kind=LAT_TOP };
+					const ssa_ref *labels = (ssa_ref*) &i[1], *values = labels + i->R;
+					for (ssa_ref j = 0; j < i->R; j++)
+						if (edge_executable(&cfg, exec_edge, labels[j], b))
+							v = meet(v, lat[values[j]]);
+				} else {
+					v = sccp_eval(f, i, lat);
+				}
+				// only ever goes down the lattice
+				v = meet(lat[def], v);
+				if (v.kind != lat[def].kind || v.v != lat[def].v) {
+					lat[def] = v;
+					changed = true;
+				}
+			}
+			if (!terminated && cfg.succ[b][0] != REF_NONE) {
+				changed |= mark(&exec_edge[b][0]);
+				changed |= mark(&exec_block[cfg.succ[b][0]]);
+			}
+		}
+		if (changed) continue;
+		// a branch on a value that's still undefined at the fixpoint (only defined on the paths found dead)
+		// can go either way: its operands aren't constants, and both edges get explored
+		for (idx_t k = 0; k < cfg.num_reachable; k++) {
+			ssa_ref b = cfg.rpo[k];
+			if (!exec_block[b]) continue;
+			for (ssa_instr *i = instr_at(f, nodes[b].begin), *end = instr_at(f, cfg.ends[b]); i != end; i = next_instr(i)) {
+				if (i->kind != SSA_BR) continue;
+				for (int s = 0; s < 2; s++) {
+					lattice *op = &lat[s? i->R: i->L];
+					if (op->kind != LAT_TOP) continue;
+					*op = (lattice){ .kind=LAT_BOTTOM };
+					changed = true;
+				}
+			}
+		}
+	}
+
+	// labels of the blocks that stay, in the same order so that fallthroughs still work
+	allocation mr = ALLOC(a, n * sizeof(ssa_ref), alignof(ssa_ref));
+	ssa_ref *relabel = mr.addr, kept = 0;
+	for (idx_t b = 0; b < n; b++)
+		relabel[b] = exec_block[b]? kept++: REF_NONE;
+
+	dyn_arr ins; dyn_arr_init(&ins, dyn_arr_size(&f->ins), a);
+	dyn_arr out_nodes; dyn_arr_init(&out_nodes, kept * sizeof(ir3_node), a);
+	for (idx_t b = 0; b < n; b++) {
+		if (!exec_block[b]) continue;
+		idx_t begin = dyn_arr_size(&ins);
+		// the phis that remain come first, then everything else
+		for (int pass = 0; pass < 2; pass++)
+		for (ssa_instr *i = instr_at(f, nodes[b].begin), *end = instr_at(f, cfg.ends[b]); i != end; i = next_instr(i)) {
+			ssa_ref def = ssa_def(i);
+			ssa_ref entries = i->kind == SSA_PHI? phi_entries(&cfg, exec_edge, i, b): 0;
+			bool stays_phi = i->kind == SSA_PHI && entries > 1 && lat[def].kind != LAT_CONST;
+			if (stays_phi != (pass == 0)) continue;
+			if (def != REF_NONE && lat[def].kind == LAT_CONST) {
+				if (local_type(f, def)->kind == TYPE_BOOL) {
+					dyn_arr_push(&ins, &(ssa_instr){ .kind=SSA_BOOL, def, lat[def].v }, sizeof(ssa_instr), a);
+				} else {
+					dyn_arr_push(&ins, &(ssa_instr){ .kind=SSA_IMM, def }, sizeof(ssa_instr), a);
+					dyn_arr_push(&ins, &(ssa_instr){ .v=lat[def].v }, sizeof(ssa_instr), a);
+				}
+				continue;
+			}
+			switch (i->kind) {
+			case SSA_PHI:
+				{
+				assert(entries > 0);
+				const ssa_ref *labels = (ssa_ref*) &i[1], *values = labels + i->R;
+				if (entries == 1) {
+					ssa_ref j = 0;
+					while (!edge_executable(&cfg, exec_edge, labels[j], b)) j++;
+					dyn_arr_push(&ins, &(ssa_instr){ .kind=SSA_COPY, i->to, values[j] }, sizeof(ssa_instr), a);
+					break;
+				}
+				ssa_instr phi = { .kind=SSA_PHI, i->to, .R=entries };
+				idx_t num_ext = ssa_ext_len(&phi);
+				dyn_arr_push(&ins, &phi, sizeof phi, a);
+				ssa_instr *ext = dyn_arr_push(&ins, NULL, num_ext * sizeof *ext, a);
+				memset(ext, 0, num_ext * sizeof *ext);
+				ssa_ref *new_labels = (ssa_ref*) ext, *new_values = new_labels + entries;
+				for (ssa_ref j = 0, k = 0; j < i->R; j++) {
+					if (!edge_executable(&cfg, exec_edge, labels[j], b)) continue;
+					new_labels[k] = relabel[labels[j]];
+					new_values[k++] = values[j];
+				}
+				}
+				break;
+			case SSA_BR:
+				if (exec_edge[b][0] && exec_edge[b][1]) {
+					ssa_instr *br = dyn_arr_push(&ins, i, 2 * sizeof *i, a);
+					br[1].L = relabel[br[1].L];
+					br[1].R = relabel[br[1].R];
+				} else {
+					ssa_ref taken = cfg.succ[b][exec_edge[b][0]? 0: 1];
+					dyn_arr_push(&ins, &(ssa_instr){ .kind=SSA_GOTO, relabel[taken] }, sizeof(ssa_instr), a);
+				}
+				break;
+			case SSA_GOTO:
+				dyn_arr_push(&ins, &(ssa_instr){ .kind=SSA_GOTO, relabel[i->to] }, sizeof(ssa_instr), a);
+				break;
+			default:
+				dyn_arr_push(&ins, i, (1 + ssa_ext_len(i)) * sizeof *i, a);
+				break;
+			}
+		}
+		dyn_arr_push(&out_nodes, &(ir3_node){ .begin=begin, .end=dyn_arr_size(&ins) }, sizeof(ir3_node), a);
+	}
+	dyn_arr_fini(&f->ins, a);
+	dyn_arr_fini(&f->nodes, a);
+	f->ins = ins;
+	f->nodes = out_nodes;
+
+	DEALLOC(a, mr);
+	DEALLOC(a, mb);
+	DEALLOC(a, ml);
+	cfg_fini(&cfg, a);
+}
+
+// a local can stand for its value when it has a single definition that dominates all of its uses
+// and nothing writes to it through its address, `def_at` is then the position of that definition
+static void find_stable(const ir3_func *f, const ir3_cfg *cfg, bool *stable, idx_t *def_at, allocator *a)
+{
+	idx_t nv = dyn_arr_size(&f->locals) / sizeof(type*);
+	const ir3_node *nodes = f->nodes.buf.addr;
+	ssa_instr *start = f->ins.buf.addr;
+	allocation m = ALLOC(a, nv * (sizeof(ssa_ref) + sizeof(idx_t)), alignof(idx_t));
+	ssa_ref *def_block = m.addr;
+	idx_t *defs = (idx_t*) def_block + nv;
+	for (idx_t v = 0; v < nv; v++)
+		defs[v] = 0;
+	for (idx_t k = 0; k < cfg->num_reachable; k++) {
+		ssa_ref b = cfg->rpo[k];
+		for (ssa_instr *i = instr_at(f, nodes[b].begin), *end = instr_at(f, cfg->ends[b]); i != end; i = next_instr(i)) {
+			if (i->kind == SSA_ADDRESS)
+				defs[i->L] = 2; // anything can write to it
+			ssa_ref def = ssa_def(i);
+			if (def == REF_NONE) continue;
+			defs[def]++;
+			def_block[def] = b;
+			def_at[def] = i - start;
+		}
+	}
+	for (idx_t v = 0; v < nv; v++)
+		stable[v] = defs[v] == 1;
+	// a variable that was not renamed can still be read on a path that skips its only definition
+	for (idx_t k = 0; k < cfg->num_reachable; k++) {
+		ssa_ref b = cfg->rpo[k];
+		for (ssa_instr *i = instr_at(f, nodes[b].begin), *end = instr_at(f, cfg->ends[b]); i != end; i = next_instr(i)) {
+			ssa_ref *use_end, *use = ssa_uses(i, &use_end);
+			for (idx_t j = 0; use != use_end; use++, j++) {
+				if (!stable[*use]) continue;
+				if (i->kind == SSA_PHI) {
+					ssa_ref pred = ((ssa_ref*) &i[1])[j];
+					stable[*use] = cfg_dominates(cfg, def_block[*use], pred);
+				} else if (def_block[*use] == b) {
+					stable[*use] = def_at[*use] < i - start;
+				} else {
+					stable[*use] = cfg_dominates(cfg, def_block[*use], b);
+				}
+			}
+		}
+	}
+	DEALLOC(a, m);
+}
+
+typedef struct gvn_key {
+	ssa_kind kind;
+	ssa_ref L, R;
+	ssa_extension v;
+	const type *t;
+} gvn_key;
+
+static size_t gvn_hash(key_t k)
+{
+	const gvn_key *g = (gvn_key*) k;
+	size_t h = g->kind;
+	h = h * 0x9e3779b97f4a7c15UL ^ g->L;
+	h = h * 0x9e3779b97f4a7c15UL ^ g->R;
+	h = h * 0x9e3779b97f4a7c15UL ^ g->v;
+	h = h * 0x9e3779b97f4a7c15UL ^ (uintptr_t) g->t;
+	return h ^ h >> 29;
+}
+
+static key_t gvn_cmp(key_t L, key_t R)
+{
+	const gvn_key *l = (gvn_key*) L, *r = (gvn_key*) R;
+	return !(l->kind == r->kind && l->L == r->L && l->R == r->R && l->v == r->v && l->t == r->t);
+}
+
+typedef struct gvn_state {
+	ir3_func *f;
+	ir3_cfg *cfg;
+	const bool *stable;
+	ssa_ref *rep; // the value a local was found to be equal to, itself by default
+	map table; // gvn_key* -> index in `keys`
+	gvn_key *keys;
+	idx_t num_keys;
+	ssa_ref *leader; // [key] = the local holding that value in the current scope, REF_NONE if none
+	dyn_arr undo; // gvn_undo
+	allocator *a;
+} gvn_state;
+
+typedef struct gvn_undo {
+	idx_t key;
+	ssa_ref leader;
+} gvn_undo;
+
+// fills `key` for the computations that only depend on their operands, returns false for the others
+static bool gvn_key_of(const gvn_state *st, const ssa_instr *i, gvn_key *key)
+{
+	*key = (gvn_key){ .kind=i->kind, .t=local_type(st->f, i->to) };
+	switch (i->kind) {
+	case SSA_ADD: case SSA_MUL:
+		key->L = i->L < i->R? i->L: i->R;
+		key->R = i->L < i->R? i->R: i->L;
+		return st->stable[i->L] && st->stable[i->R];
+	case SSA_SUB:
+		key->L = i->L, key->R = i->R;
+		return st->stable[i->L] && st->stable[i->R];
+	case SSA_SET:
+		key->L = i->L, key->R = i->R, key->v = i[1].to;
+		return st->stable[i->L] && st->stable[i->R];
+	case SSA_CONVERT:
+		key->L = i->L, key->R = i->R;
+		return st->stable[i->L];
+	case SSA_BOOL_NEG:
+		key->L = i->L;
+		return st->stable[i->L];
+	case SSA_IMM:
+	case SSA_GLOBAL_REF:
+		key->v = i[1].v;
+		return true;
+	case SSA_BOOL:
+	case SSA_ADDRESS: // the address of a local does not depend on its value
+		key->L = i->L;
+		return true;
+	case SSA_OFFSETOF:
+		key->L = i->L, key->R = i->R;
+		return true;
+	default:
+		return false;
+	}
+}
+
+static void gvn_block(gvn_state *st, ssa_ref b)
+{
+	idx_t mark = dyn_arr_size(&st->undo);
+	const ir3_node *node = (ir3_node*) st->f->nodes.buf.addr + b;
+	for (ssa_instr *i = instr_at(st->f, node->begin), *end = instr_at(st->f, st->cfg->ends[b]); i != end; i = next_instr(i)) {
+		// the phis read at the end of the predecessors, they are renamed once everything has been visited
+		if (i->kind == SSA_PHI) continue;
+		ssa_ref *use_end, *use = ssa_uses(i, &use_end);
+		for (; use != use_end; use++)
+			*use = st->rep[*use];
+		ssa_ref def = ssa_def(i);
+		if (def == REF_NONE || !st->stable[def]) continue;
+		if (i->kind == SSA_COPY) {
+			if (st->stable[i->L] && local_type(st->f, i->L) == local_type(st->f, def))
+				st->rep[def] = i->L;
+			continue;
+		}
+		gvn_key *key = &st->keys[st->num_keys];
+		if (!gvn_key_of(st, i, key)) continue;
+		bool inserted;
+		map_entry *e = map_id(&st->table, (key_t) key, gvn_hash, gvn_cmp, &inserted, st->a);
+		if (inserted) {
+			e->v = st->num_keys;
+			st->leader[st->num_keys++] = REF_NONE;
+		}
+		if (st->leader[e->v] != REF_NONE) {
+			st->rep[def] = st->leader[e->v];
+		} else {
+			dyn_arr_push(&st->undo, &(gvn_undo){ e->v, REF_NONE }, sizeof(gvn_undo), st->a);
+			st->leader[e->v] = def;
+		}
+	}
+
+	for (idx_t c = st->cfg->child_begin[b]; c < st->cfg->child_begin[b+1]; c++)
+		gvn_block(st, st->cfg->children[c]);
+
+	for (gvn_undo *u = st->undo.end; (idx_t) dyn_arr_size(&st->undo) != mark; ) {
+		u--;
+		st->leader[u->key] = u->leader;
+		dyn_arr_pop(&st->undo, sizeof *u);
+	}
+}
+
+void opt_gvn(ir3_func *f, allocator *a)
+{
+	ir3_cfg cfg;
+	cfg_init(&cfg, f, a);
+	idx_t n = cfg.num_blocks, nv = dyn_arr_size(&f->locals) / sizeof(type*);
+	idx_t slots = dyn_arr_size(&f->ins) / sizeof(ssa_instr);
+	if (!n) {
+		cfg_fini(&cfg, a);
+		return;
+	}
+	const ir3_node *nodes = f->nodes.buf.addr;
+	allocation mv = ALLOC(a, nv * (sizeof(ssa_ref) + sizeof(idx_t) + sizeof(bool)), alignof(idx_t));
+	ssa_ref *rep = mv.addr;
+	idx_t *def_at = (idx_t*) rep + nv;
+	bool *stable = (bool*) (def_at + nv);
+	for (idx_t v = 0; v < nv; v++)
+		rep[v] = v;
+	find_stable(f, &cfg, stable, def_at, a);
+
+	gvn_state st = { .f=f, .cfg=&cfg, .stable=stable, .rep=rep, .a=a };
+	allocation mk = ALLOC(a, slots * (sizeof(gvn_key) + sizeof(ssa_ref)), alignof(gvn_key));
+	st.keys = mk.addr;
+	st.leader = (ssa_ref*) (st.keys + slots);
+	map_init(&st.table, 2 * slots, a);
+	dyn_arr_init(&st.undo, 0, a);
+	gvn_block(&st, 0);
+	dyn_arr_fini(&st.undo, a);
+	map_fini(&st.table, a);
+	DEALLOC(a, mk);
+
+	// the representatives are final, the phis get theirs now
+	for (idx_t k = 0; k < cfg.num_reachable; k++) {
+		ssa_ref b = cfg.rpo[k];
+		for (ssa_instr *i = instr_at(f, nodes[b].begin), *end = instr_at(f, cfg.ends[b]); i != end; i = next_instr(i)) {
+			if (i->kind != SSA_PHI) continue;
+			ssa_ref *use_end, *use = ssa_uses(i, &use_end);
+			for (; use != use_end; use++)
+				*use = rep[*use];
+		}
+	}
+	DEALLOC(a, mv);
+	cfg_fini(&cfg, a);
+}
+
+// `base + index*scale + disp`, scale 0 when there is no index
+typedef struct addr_form {
+	ssa_ref base, index;
+	uint32_t scale;
+	int64_t disp;
+	bool known; // set on the locals defined by a foldable lea, muli or imm
+} addr_form;
+
+static bool fits_int32(int64_t v)
+{
+	return INT32_MIN <= v && v <= INT32_MAX;
+}
+
+// how `v` reads as an address form, from the definitions that can be moved to its uses
+static addr_form unfold(const ir3_func *f, const addr_form *form, const bool *stable, ssa_ref v, uint64_t size)
+{
+	if (stable[v] && form[v].known && local_type(f, v)->size == size)
+		return form[v];
+	return (addr_form){ .base=v, .index=REF_NONE };
+}
+
+// at most a base and a scaled index
+static bool combine(addr_form L, addr_form R, addr_form *out)
+{
+	ssa_ref terms[4];
+	uint32_t scales[4];
+	int n = 0;
+	for (const addr_form *x = &L; x; x = x == &L? &R: NULL) {
+		if (x->base != REF_NONE) terms[n] = x->base, scales[n++] = 1;
+		if (x->scale) terms[n] = x->index, scales[n++] = x->scale;
+	}
+	if (n == 0 || n > 2) return false;
+	*out = (addr_form){ .base=terms[0], .index=REF_NONE, .disp=L.disp + R.disp, .known=true };
+	if (n == 2) {
+		if (scales[0] != 1 && scales[1] != 1) return false;
+		int b = scales[0] == 1? 0: 1;
+		*out = (addr_form){ .base=terms[b], .index=terms[!b], .scale=scales[!b], .disp=out->disp, .known=true };
+	} else if (scales[0] != 1) {
+		return false; // an index without a base only encodes with a 32-bit displacement
+	}
+	return true;
+}
+
+static void push_form(dyn_arr *ins, ssa_ref to, addr_form x, allocator *a)
+{
+	if (!x.scale && !x.disp) {
+		dyn_arr_push(ins, &(ssa_instr){ .kind=SSA_COPY, to, x.base }, sizeof(ssa_instr), a);
+		return;
+	}
+	dyn_arr_push(ins, &(ssa_instr){ .kind=SSA_LEA, to, x.base, x.scale? x.index: x.base }, sizeof(ssa_instr), a);
+	dyn_arr_push(ins, &(ssa_instr){ .L=x.scale, .R=(uint32_t) x.disp }, sizeof(ssa_instr), a);
+}
+
+void opt_addressing(ir3_func *f, allocator *a)
+{
+	ir3_cfg cfg;
+	cfg_init(&cfg, f, a);
+	idx_t n = cfg.num_blocks, nv = dyn_arr_size(&f->locals) / sizeof(type*);
+	ir3_node *nodes = f->nodes.buf.addr;
+	allocation mv = ALLOC(a, nv * (sizeof(addr_form) + sizeof(idx_t) + sizeof(bool)), alignof(addr_form));
+	addr_form *form = mv.addr;
+	idx_t *def_at = (idx_t*) (form + nv);
+	bool *stable = (bool*) (def_at + nv);
+	for (idx_t v = 0; v < nv; v++)
+		form[v].known = false;
+	find_stable(f, &cfg, stable, def_at, a);
+
+	// the rpo visits the definitions that dominate a use before it
+	dyn_arr ins; dyn_arr_init(&ins, dyn_arr_size(&f->ins), a);
+	allocation mb = ALLOC(a, n * sizeof(ir3_node), alignof(ir3_node));
+	ir3_node *placed = mb.addr;
+	for (idx_t b = 0; b < n; b++)
+		placed[b] = (ir3_node){ 0, 0 };
+	for (idx_t k = 0; k < cfg.num_reachable; k++) {
+		ssa_ref b = cfg.rpo[k];
+		placed[b].begin = dyn_arr_size(&ins);
+		for (ssa_instr *i = instr_at(f, nodes[b].begin), *end = instr_at(f, cfg.ends[b]); i != end; i = next_instr(i)) {
+			uint64_t size = i->kind == SSA_ADD || i->kind == SSA_SUB || i->kind == SSA_MUL? local_type(f, i->to)->size: 0;
+			addr_form L = {0}, R = {0}, x;
+			if (size) {
+				L = unfold(f, form, stable, i->L, size);
+				R = unfold(f, form, stable, i->R, size);
+			}
+			bool Lk = L.known && L.base == REF_NONE && !L.scale, Rk = R.known && R.base == REF_NONE && !R.scale;
+			if (i->kind == SSA_IMM && stable[i->to] && fits_int32(truncate(i[1].v, local_type(f, i->to)->size))) {
+				form[i->to] = (addr_form){ .base=REF_NONE, .index=REF_NONE, .disp=truncate(i[1].v, local_type(f, i->to)->size), .known=true };
+			} else if (i->kind == SSA_MUL && (Lk || Rk) && fits_int32(Lk? L.disp: R.disp) && (Lk? L.disp: R.disp) != 0) {
+				int64_t c = Lk? L.disp: R.disp;
+				ssa_ref by = Lk? i->R: i->L;
+				if (c == 1) {
+					dyn_arr_push(&ins, &(ssa_instr){ .kind=SSA_COPY, i->to, by }, sizeof(ssa_instr), a);
+					continue;
+				}
+				dyn_arr_push(&ins, &(ssa_instr){ .kind=SSA_MULI, i->to, by }, sizeof(ssa_instr), a);
+				dyn_arr_push(&ins, &(ssa_instr){ .v=c }, sizeof(ssa_instr), a);
+				if (stable[i->to] && stable[by] && (c == 2 || c == 4 || c == 8))
+					form[i->to] = (addr_form){ .base=REF_NONE, .index=by, .scale=c, .known=true };
+				continue;
+			} else if (i->kind == SSA_SUB && Rk && !Lk) {
+				R.disp = -R.disp;
+				addr_form plain = { .base=i->L, .index=REF_NONE };
+				if (!combine(L, R, &x) && !combine(plain, R, &x)) goto keep;
+				x.disp = truncate(x.disp, size);
+				if (!fits_int32(x.disp)) goto keep;
+				goto fold;
+			} else if (i->kind == SSA_ADD && !(Lk && Rk) && (L.known || R.known)) {
+				addr_form Lp = { .base=i->L, .index=REF_NONE }, Rp = { .base=i->R, .index=REF_NONE };
+				if (!combine(L, R, &x) && !(R.known && combine(Lp, R, &x)) && !(L.known && combine(L, Rp, &x))) goto keep;
+				x.disp = truncate(x.disp, size);
+				if (!fits_int32(x.disp)) goto keep;
+				goto fold;
+			}
+keep:
+			dyn_arr_push(&ins, i, (1 + ssa_ext_len(i)) * sizeof *i, a);
+			continue;
+fold:
+			push_form(&ins, i->to, x, a);
+			if (!stable[i->to]) continue;
+			if (!stable[x.base] || (x.scale && !stable[x.index])) continue;
+			form[i->to] = x;
+		}
+		placed[b].end = dyn_arr_size(&ins);
+	}
+	for (idx_t b = 0; b < n; b++)
+		nodes[b] = cfg.order[b] >= 0? placed[b]: (ir3_node){ dyn_arr_size(&ins), dyn_arr_size(&ins) };
+	dyn_arr_fini(&f->ins, a);
+	f->ins = ins;
+
+	DEALLOC(a, mb);
+	DEALLOC(a, mv);
+	cfg_fini(&cfg, a);
+}
+
+static bool has_side_effect(const ssa_instr *i)
+{
+	switch (i->kind) {
+	case SSA_RET:
+	case SSA_GOTO:
+	case SSA_BR:
+	case SSA_STORE:
+	case SSA_CALL:
+		return true;
+	default:
+		return false;
+	}
+}
+
+// instructions that may read a local through its address
+static bool reads_memory(const ssa_instr *i)
+{
+	return i->kind == SSA_LOAD || i->kind == SSA_CALL || i->kind == SSA_MEMCOPY;
+}
+
+static void compact_locals(ir3_func *f, allocator *a)
+{
+	idx_t nv = dyn_arr_size(&f->locals) / sizeof(type*);
+	allocation m = ALLOC(a, nv * sizeof(ssa_ref), alignof(ssa_ref));
+	ssa_ref *renum = m.addr;
+	for (idx_t v = 0; v < nv; v++)
+		renum[v] = REF_NONE;
+	for (ssa_instr *i = f->ins.buf.addr; i != f->ins.end; i = next_instr(i)) {
+		ssa_ref *use_end, *use = ssa_uses(i, &use_end);
+		for (; use != use_end; use++)
+			renum[*use] = 0;
+		ssa_ref def = ssa_def(i);
+		if (def != REF_NONE) renum[def] = 0;
+	}
+	dyn_arr locals; dyn_arr_init(&locals, 0, a);
+	type **ltypes = f->locals.buf.addr;
+	for (idx_t v = 0; v < nv; v++) {
+		if (renum[v] == REF_NONE) continue;
+		renum[v] = dyn_arr_size(&locals) / sizeof(type*);
+		dyn_arr_push(&locals, &ltypes[v], sizeof(type*), a);
+	}
+	for (ssa_instr *i = f->ins.buf.addr; i != f->ins.end; i = next_instr(i)) {
+		ssa_ref def = ssa_def(i);
+		ssa_ref *use_end, *use = ssa_uses(i, &use_end);
+		for (; use != use_end; use++)
+			*use = renum[*use];
+		if (def != REF_NONE) i->to = renum[def];
+	}
+	dyn_arr_fini(&f->locals, a);
+	f->locals = locals;
+	DEALLOC(a, m);
+}
+
+void opt_dce(ir3_func *f, allocator *a)
+{
+	ir3_cfg cfg;
+	cfg_init(&cfg, f, a);
+	idx_t n = cfg.num_blocks, nv = dyn_arr_size(&f->locals) / sizeof(type*);
+	idx_t slots = dyn_arr_size(&f->ins) / sizeof(ssa_instr);
+	const ir3_node *nodes = f->nodes.buf.addr;
+	ssa_instr *start = f->ins.buf.addr;
+	// per instruction: live, overwritten, next definition of the same local
+	// per local: addressed, live, first definition, last definition in the current block
+	allocation mi = ALLOC(a, slots * (2*sizeof(bool) + sizeof(idx_t)) + nv * (2*sizeof(bool) + 2*sizeof(idx_t)), alignof(idx_t));
+	idx_t *def_next = mi.addr, *def_head = def_next + slots, *last_def = def_head + nv;
+	bool *live = (bool*) (last_def + nv), *overwritten = live + slots, *addressed = overwritten + slots, *live_local = addressed + nv;
+	memset(live, 0, 2*slots + 2*nv);
+	dyn_arr in_memory; dyn_arr_init(&in_memory, 0, a); // ssa_ref
+	for (idx_t k = 0; k < cfg.num_reachable; k++) {
+		ssa_ref b = cfg.rpo[k];
+		for (ssa_instr *i = instr_at(f, nodes[b].begin), *end = instr_at(f, cfg.ends[b]); i != end; i = next_instr(i))
+			if (i->kind == SSA_ADDRESS && !addressed[i->L]) {
+				addressed[i->L] = true;
+				dyn_arr_push(&in_memory, &i->L, sizeof(ssa_ref), a);
+			}
+	}
+
+	// dead stores: a definition overwritten later in the block, with nothing reading the local in between
+	for (idx_t k = 0; k < cfg.num_reachable; k++) {
+		ssa_ref b = cfg.rpo[k];
+		for (idx_t v = 0; v < nv; v++)
+			last_def[v] = -1;
+		for (ssa_instr *i = instr_at(f, nodes[b].begin), *end = instr_at(f, cfg.ends[b]); i != end; i = next_instr(i)) {
+			ssa_ref *use_end, *use = ssa_uses(i, &use_end);
+			for (; use != use_end; use++)
+				last_def[*use] = -1;
+			if (reads_memory(i))
+				for (ssa_ref *v = in_memory.buf.addr; v != in_memory.end; v++)
+					last_def[*v] = -1;
+			ssa_ref def = ssa_def(i);
+			if (def == REF_NONE) continue;
+			if (last_def[def] != -1)
+				overwritten[last_def[def]] = true;
+			last_def[def] = i - start;
+		}
+	}
+	dyn_arr_fini(&in_memory, a);
+
+	// mark from the side effects, through the definitions of every local read
+	for (idx_t v = 0; v < nv; v++)
+		def_head[v] = -1;
+	dyn_arr work; dyn_arr_init(&work, 0, a);
+	for (idx_t k = 0; k < cfg.num_reachable; k++) {
+		ssa_ref b = cfg.rpo[k];
+		for (ssa_instr *i = instr_at(f, nodes[b].begin), *end = instr_at(f, cfg.ends[b]); i != end; i = next_instr(i)) {
+			idx_t at = i - start;
+			ssa_ref def = ssa_def(i);
+			if (def != REF_NONE && !overwritten[at]) {
+				def_next[at] = def_head[def];
+				def_head[def] = at;
+			}
+			if (has_side_effect(i)) {
+				live[at] = true;
+				dyn_arr_push(&work, &at, sizeof at, a);
+			}
+		}
+	}
+	while (!dyn_arr_empty(&work)) {
+		idx_t at = *(idx_t*) (work.end - sizeof at);
+		dyn_arr_pop(&work, sizeof at);
+		ssa_ref *use_end, *use = ssa_uses(&start[at], &use_end);
+		for (; use != use_end; use++) {
+			if (live_local[*use]) continue;
+			live_local[*use] = true;
+			for (idx_t d = def_head[*use]; d != -1; d = def_next[d]) {
+				if (live[d]) continue;
+				live[d] = true;
+				dyn_arr_push(&work, &d, sizeof d, a);
+			}
+		}
+	}
+	dyn_arr_fini(&work, a);
+
+	dyn_arr ins; dyn_arr_init(&ins, dyn_arr_size(&f->ins), a);
+	ir3_node *wnodes = f->nodes.buf.addr;
+	for (idx_t b = 0; b < n; b++) {
+		idx_t begin = dyn_arr_size(&ins);
+		if (cfg.order[b] >= 0)
+			for (ssa_instr *i = instr_at(f, wnodes[b].begin), *end = instr_at(f, cfg.ends[b]); i != end; i = next_instr(i))
+				if (live[i - start])
+					dyn_arr_push(&ins, i, (1 + ssa_ext_len(i)) * sizeof *i, a);
+		wnodes[b] = (ir3_node){ .begin=begin, .end=dyn_arr_size(&ins) };
+	}
+	dyn_arr_fini(&f->ins, a);
+	f->ins = ins;
+
+	DEALLOC(a, mi);
+	cfg_fini(&cfg, a);
+	compact_locals(f, a);
+}
+
+// instructions, the extensions aside
+#define INLINE_ALWAYS 12
+#define INLINE_ONCE 48 // for a callee that is called from a single place in the module
+#define INLINE_GROWTH 2048 // past that, the caller doesn't take any more bodies
+
+static idx_t func_cost(const ir3_func *f)
+{
+	idx_t cost = 0;
+	for (ssa_instr *i = f->ins.buf.addr; i != f->ins.end; i = next_instr(i))
+		cost++;
+	return cost;
+}
+
+typedef struct inline_site {
+	ssa_ref callee;
+	ssa_ref base; // of the locals of the callee in the caller
+	ssa_ref lbase; // of its labels
+	ssa_ref result, cont;
+} inline_site;
+
+static void rebase(ssa_instr *i, ssa_ref base, ssa_ref lbase)
+{
+	ssa_ref *end, *use = ssa_uses(i, &end);
+	for (; use != end; use++)
+		*use += base;
+	if (ssa_def(i) != REF_NONE) i->to += base;
+	if (i->kind == SSA_GOTO) i->to += lbase;
+	if (i->kind == SSA_BR) {
+		i[1].L += lbase;
+		i[1].R += lbase;
+	}
+}
+
+static ir3_node *node_at(dyn_arr *nodes, ssa_ref b)
+{
+	return (ir3_node*) nodes->buf.addr + b;
+}
+
+// the calls worth it are replaced by copies into the parameters of the callee and a jump to its body,
+// which is appended with its locals and labels moved past the ones of the caller
+// the returns become copies into the result and jumps to the rest of the block of the call
+static void inline_calls(ir3_sym *syms, ssa_ref self, const idx_t *cost, const idx_t *sites, allocator *a)
+{
+	ir3_func *f = &syms[self].f;
+	idx_t n = dyn_arr_size(&f->nodes) / sizeof(ir3_node), size = cost[self];
+	dyn_arr ins, nodes, pending;
+	dyn_arr_init(&ins, dyn_arr_size(&f->ins), a);
+	dyn_arr_init(&nodes, 0, a);
+	dyn_arr_init(&pending, 0, a);
+	dyn_arr_push(&nodes, f->nodes.buf.addr, n * sizeof(ir3_node), a);
+	for (idx_t b = 0; b < n; b++) {
+		ssa_ref cur = b;
+		bool split = false, terminated = false;
+		node_at(&nodes, cur)->begin = dyn_arr_size(&ins);
+		for (ssa_instr *i = instr_at(f, node_at(&f->nodes, b)->begin), *end = instr_at(f, node_at(&f->nodes, b)->end);
+				i != end; i = next_instr(i)) {
+			ssa_ref callee = i->kind == SSA_CALL? i[1].v: REF_NONE;
+			bool worth = callee != REF_NONE && callee != self && syms[callee].kind == IR3_FUNC
+				&& size + cost[callee] <= INLINE_GROWTH
+				&& (cost[callee] <= INLINE_ALWAYS || (sites[callee] == 1 && cost[callee] <= INLINE_ONCE));
+			if (!worth) {
+				dyn_arr_push(&ins, i, (1 + ssa_ext_len(i)) * sizeof *i, a);
+				terminated |= ssa_is_terminator(i);
+				continue;
+			}
+			ir3_func *g = &syms[callee].f;
+			inline_site site = {
+				.callee = callee,
+				.base = dyn_arr_size(&f->locals) / sizeof(type*),
+				.lbase = dyn_arr_size(&nodes) / sizeof(ir3_node),
+				.result = i->to,
+			};
+			site.cont = site.lbase + dyn_arr_size(&g->nodes) / sizeof(ir3_node);
+			dyn_arr_push(&f->locals, g->locals.buf.addr, dyn_arr_size(&g->locals), a);
+			dyn_arr_push(&nodes, NULL, (site.cont + 1 - site.lbase) * sizeof(ir3_node), a);
+			const ssa_ref *args = (const ssa_ref*) &i[2];
+			for (ssa_instr *arg = g->ins.buf.addr; arg != g->ins.end; arg = next_instr(arg))
+				if (arg->kind == SSA_ARG && arg->L < i->R)
+					dyn_arr_push(&ins, &(ssa_instr){ .kind=SSA_COPY, arg->to + site.base, args[arg->L] }, sizeof(ssa_instr), a);
+			dyn_arr_push(&ins, &(ssa_instr){ .kind=SSA_GOTO, site.lbase }, sizeof(ssa_instr), a);
+			node_at(&nodes, cur)->end = dyn_arr_size(&ins);
+			cur = site.cont;
+			node_at(&nodes, cur)->begin = dyn_arr_size(&ins);
+			dyn_arr_push(&pending, &site, sizeof site, a);
+			size += cost[callee];
+			split = true;
+		}
+		// the rest of the block is not right before the next one anymore
+		if (split && !terminated && b + 1 < n)
+			dyn_arr_push(&ins, &(ssa_instr){ .kind=SSA_GOTO, b + 1 }, sizeof(ssa_instr), a);
+		node_at(&nodes, cur)->end = dyn_arr_size(&ins);
+	}
+
+	for (inline_site *site = pending.buf.addr; site != pending.end; site++) {
+		ir3_func *g = &syms[site->callee].f;
+		idx_t m = dyn_arr_size(&g->nodes) / sizeof(ir3_node);
+		for (idx_t b = 0; b < m; b++) {
+			node_at(&nodes, site->lbase + b)->begin = dyn_arr_size(&ins);
+			for (ssa_instr *i = instr_at(g, node_at(&g->nodes, b)->begin), *end = instr_at(g, node_at(&g->nodes, b)->end);
+					i != end; i = next_instr(i)) {
+				if (i->kind == SSA_ARG) continue;
+				if (i->kind == SSA_RET) {
+					dyn_arr_push(&ins, &(ssa_instr){ .kind=SSA_COPY, site->result, i->to + site->base }, sizeof(ssa_instr), a);
+					dyn_arr_push(&ins, &(ssa_instr){ .kind=SSA_GOTO, site->cont }, sizeof(ssa_instr), a);
+					continue;
+				}
+				idx_t len = (1 + ssa_ext_len(i)) * sizeof *i;
+				rebase(dyn_arr_push(&ins, i, len, a), site->base, site->lbase);
+			}
+			node_at(&nodes, site->lbase + b)->end = dyn_arr_size(&ins);
+		}
+	}
+
+	dyn_arr_fini(&pending, a);
+	dyn_arr_fini(&f->ins, a);
+	dyn_arr_fini(&f->nodes, a);
+	f->ins = ins;
+	f->nodes = nodes;
+}
+
+void opt_inline(ir3_module m, allocator *a)
+{
+	ir3_sym *syms = scratch_start(m);
+	idx_t nsyms = scratch_len(m) / sizeof *syms;
+	allocation mc = ALLOC(a, 2 * nsyms * sizeof(idx_t) + 1, alignof(idx_t));
+	idx_t *cost = mc.addr, *sites = cost + nsyms;
+	for (idx_t s = 0; s < nsyms; s++) {
+		cost[s] = syms[s].kind == IR3_FUNC? func_cost(&syms[s].f): 0;
+		sites[s] = 0;
+	}
+	for (idx_t s = 0; s < nsyms; s++) {
+		if (syms[s].kind != IR3_FUNC) continue;
+		for (ssa_instr *i = syms[s].f.ins.buf.addr; i != syms[s].f.ins.end; i = next_instr(i))
+			if (i->kind == SSA_CALL) sites[i[1].v]++;
+	}
+	// in the order of the module, so a callee declared earlier comes with its own calls already inlined
+	for (idx_t s = 0; s < nsyms; s++) {
+		if (syms[s].kind != IR3_FUNC) continue;
+		inline_calls(syms, s, cost, sites, a);
+		cost[s] = func_cost(&syms[s].f);
+	}
+	DEALLOC(a, mc);
+}
+
+void optimize(ir3_module m, allocator *a)
+{
+	for (ir3_sym *s = scratch_start(m); s != scratch_end(m); s++) {
+		if (s->kind != IR3_FUNC) continue;
+		opt_sccp(&s->f, a);
+		opt_gvn(&s->f, a);
+		opt_addressing(&s->f, a);
+		opt_dce(&s->f, a);
+	}
+}
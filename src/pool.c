@@ -0,0 +1,56 @@
+#include "pool.h"
+
+#include <threads.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+
+#define POOL_MAX 64
+
+typedef struct pool_work {
+	atomic_size_t next;
+	size_t n;
+	void (*fn)(void *ctx, size_t i, int worker);
+	void *ctx;
+	atomic_int workers;
+} pool_work;
+
+int pool_jobs(void)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n < 1? 1: n > POOL_MAX? POOL_MAX: n;
+}
+
+int parallel_jobs(size_t n, int jobs)
+{
+	if (jobs <= 0) jobs = pool_jobs();
+	if (jobs > POOL_MAX) jobs = POOL_MAX;
+	if ((size_t) jobs > n) jobs = n;
+	return jobs < 1? 1: jobs;
+}
+
+static int pool_worker(void *arg)
+{
+	pool_work *w = arg;
+	int worker = atomic_fetch_add_explicit(&w->workers, 1, memory_order_relaxed);
+	for (size_t i; (i = atomic_fetch_add_explicit(&w->next, 1, memory_order_relaxed)) < w->n; )
+		w->fn(w->ctx, i, worker);
+	return 0;
+}
+
+void parallel_for(size_t n, int jobs, void (*fn)(void *ctx, size_t i, int worker), void *ctx)
+{
+	jobs = parallel_jobs(n, jobs);
+	pool_work w = { .n = n, .fn = fn, .ctx = ctx };
+	atomic_init(&w.next, 0);
+	atomic_init(&w.workers, 0);
+	thrd_t threads[POOL_MAX];
+	int started = 0;
+	// the calling thread takes its share, and the whole lot if no thread can be started
+	for (; started < jobs - 1; started++)
+		if (thrd_create(&threads[started], pool_worker, &w) != thrd_success)
+			break;
+	pool_worker(&w);
+	for (int t = 0; t < started; t++)
+		thrd_join(threads[t], NULL);
+}
@@ -8,6 +8,20 @@
 #include <ctype.h>
 
 
+static _Thread_local FILE *diag;
+
+FILE *diag_stream(void)
+{
+	return diag? diag: stderr;
+}
+
+FILE *diag_redirect(FILE *to)
+{
+	FILE *prev = diag;
+	diag = to;
+	return prev;
+}
+
 static int fprint_token(FILE *to, token tk)
 {
 	int len = tk.end - tk.pos;
@@ -75,49 +89,63 @@ static int fprint_ir3_instr(FILE *to, const ssa_instr *i, int *extra_offset, con
 	switch (i->kind) {
 	case SSA_SET:
 		*extra_offset = sizeof *i;
-		return fprintf(to, "%%%hhx:%s = set(%s), %%%hhx, %%%hhx\n", i->to, T, opc2s[i[1].to-SSAB_EQ], i->L, i->R);
+		return fprintf(to, "%%%x:%s = set(%s), %%%x, %%%x\n", i->to, T, opc2s[i[1].to-SSAB_EQ], i->L, i->R);
 	case SSA_IMM:
 		*extra_offset = sizeof *i;
-		return fprintf(to, "%%%hhx:%s = #%x\n", i->to, T, i[1].v);
+		return fprintf(to, "%%%x:%s = #%lx\n", i->to, T, i[1].v);
 	case SSA_BR:
 		*extra_offset = sizeof *i;
-		return fprintf(to, "br(%s) %%%hhx:%s, %%%hhx, L%hhx, L%hhx\n", opc2s[i->to], i->L, T, i->R, i[1].L, i[1].R);
+		// .to is the condition, the width is the one of the operands
+		return fprintf(to, "br(%s) %%%x:%s, %%%x, L%x, L%x\n", opc2s[i->to], i->L, type2s[((type**) locals->buf.addr)[i->L]->kind], i->R, i[1].L, i[1].R);
 	case SSA_GLOBAL_REF:
 		*extra_offset = sizeof *i;
-		return fprintf(to, "%%%hhx:%s = global.%x\n", i->to, T, i[1].v);
+		return fprintf(to, "%%%x:%s = global.%lx\n", i->to, T, i[1].v);
+	case SSA_LEA:
+		*extra_offset = sizeof *i;
+		if (!i[1].L)
+			return fprintf(to, "%%%x:%s = lea [%%%x + %d]\n", i->to, T, i->L, (int32_t) i[1].R);
+		return fprintf(to, "%%%x:%s = lea [%%%x + %%%x*%d + %d]\n", i->to, T, i->L, i->R, i[1].L, (int32_t) i[1].R);
+	case SSA_MULI:
+		*extra_offset = sizeof *i;
+		return fprintf(to, "%%%x:%s = mul %%%x, #%lx\n", i->to, T, i->L, i[1].v);
 	case SSA_CALL:
 		{
-		int div = sizeof(ssa_extension)/sizeof(ssa_ref);
-		int num_ext = (i->R + div - 1) / div + 1;
-		*extra_offset = num_ext * sizeof *i;
-		int printed = fprintf(to, "%%%hhx:%s = call sym.%x [", i->to, T, i[1].v);
-		for (int arg = 0; arg < i->R; arg++) {
+		*extra_offset = ssa_ext_len(i) * sizeof *i;
+		int printed = fprintf(to, "%%%x:%s = call sym.%lx [", i->to, T, i[1].v);
+		const ssa_ref *args = (const ssa_ref*) &i[2];
+		for (ssa_ref arg = 0; arg < i->R; arg++) {
 			if (arg) printed += fprintf(to, ", ");
-			ssa_extension ext = i[2 + arg / div].v;
-			int shift = 8 * (arg % div);
-			ssa_ref id = (ext >> shift) & ((1L << (8 * sizeof id)) - 1);
-			printed += fprintf(to, "%%%hhx", id);
+			printed += fprintf(to, "%%%x", args[arg]);
 		}
 		return printed + fprintf(to, "]\n");
 		}
-	case SSA_RET: return fprintf(to, "ret %%%hhx\n", i->to);
-	case SSA_GOTO: return fprintf(to, "goto L%hhx\n", i->to);
-	case SSA_LABEL: return fprintf(to, "label L%hhx\n", i->to);
-	case SSA_BOOL: return fprintf(to, "%%%hhx:%s = %db\n", i->to, T, i->L);
-	case SSA_COPY: return fprintf(to, "%%%hhx:%s = %%%hhx\n", i->to, T, i->L);
-	case SSA_ARG: return fprintf(to, "%%%hhx:%s = args.%hhx\n", i->to, T, i->L);
-	case SSA_LOAD: return fprintf(to, "%%%hhx:%s = load %%%hhx\n", i->to, T, i->L);
-	case SSA_STORE: return fprintf(to, "store:%s %%%hhx, %%%hhx\n", T, i->to, i->L);
-	case SSA_MEMCOPY: return fprintf(to, "%%%hhx:%s = memcopy(%%%hhx)\n", i->to, T, i->L);
-	case SSA_BOOL_NEG: return fprintf(to, "%%%hhx:%s = bool neg %%%hhx\n", i->to, T, i->L);
-	case SSA_ADDRESS: return fprintf(to, "%%%hhx:%s = addressof %%%hhx\n", i->to, T, i->L);
-	case SSA_ADD: return fprintf(to, "%%%hhx:%s = add %%%hhx, %%%hhx\n", i->to, T, i->L, i->R);
-	case SSA_SUB: return fprintf(to, "%%%hhx:%s = sub %%%hhx, %%%hhx\n", i->to, T, i->L, i->R);
-	case SSA_MUL: return fprintf(to, "%%%hhx:%s = mul %%%hhx, %%%hhx\n", i->to, T, i->L, i->R);
-	case SSA_OFFSETOF: return fprintf(to, "%%%hhx:%s = offsetof sym.%hhx.%hhx\n", i->to, T, i->L, i->R);
-	case SSA_CONVERT: return fprintf(to, "%%%hhx:%s = %%%hhx:%s\n", i->to, T, i->L, type2s[tinfo[i->L - i->to]->kind]);
+	case SSA_PHI:
+		{
+		*extra_offset = ssa_ext_len(i) * sizeof *i;
+		const ssa_ref *labels = (const ssa_ref*) &i[1], *values = labels + i->R;
+		int printed = fprintf(to, "%%%x:%s = phi", i->to, T);
+		for (ssa_ref k = 0; k < i->R; k++)
+			printed += fprintf(to, "%s [L%x: %%%x]", k? ",": "", labels[k], values[k]);
+		return printed + fprintf(to, "\n");
+		}
+	case SSA_RET: return fprintf(to, "ret %%%x\n", i->to);
+	case SSA_GOTO: return fprintf(to, "goto L%x\n", i->to);
+	case SSA_LABEL: return i->L? fprintf(to, "label L%x, align %d\n", i->to, i->L): fprintf(to, "label L%x\n", i->to);
+	case SSA_BOOL: return fprintf(to, "%%%x:%s = %db\n", i->to, T, i->L);
+	case SSA_COPY: return fprintf(to, "%%%x:%s = %%%x\n", i->to, T, i->L);
+	case SSA_ARG: return fprintf(to, "%%%x:%s = args.%x\n", i->to, T, i->L);
+	case SSA_LOAD: return fprintf(to, "%%%x:%s = load %%%x\n", i->to, T, i->L);
+	case SSA_STORE: return fprintf(to, "store:%s %%%x, %%%x\n", T, i->to, i->L);
+	case SSA_MEMCOPY: return fprintf(to, "%%%x:%s = memcopy(%%%x)\n", i->to, T, i->L);
+	case SSA_BOOL_NEG: return fprintf(to, "%%%x:%s = bool neg %%%x\n", i->to, T, i->L);
+	case SSA_ADDRESS: return fprintf(to, "%%%x:%s = addressof %%%x\n", i->to, T, i->L);
+	case SSA_ADD: return fprintf(to, "%%%x:%s = add %%%x, %%%x\n", i->to, T, i->L, i->R);
+	case SSA_SUB: return fprintf(to, "%%%x:%s = sub %%%x, %%%x\n", i->to, T, i->L, i->R);
+	case SSA_MUL: return fprintf(to, "%%%x:%s = mul %%%x, %%%x\n", i->to, T, i->L, i->R);
+	case SSA_OFFSETOF: return fprintf(to, "%%%x:%s = offsetof sym.%x.%x\n", i->to, T, i->L, i->R);
+	case SSA_CONVERT: return fprintf(to, "%%%x:%s = %%%x:%s\n", i->to, T, i->L, type2s[((type**) locals->buf.addr)[i->L]->kind]);
 	default:
-		return fprintf(to, "unknown<%hhx %hhx %hhx %hhx>\n", i->kind, i->to, i->L, i->R);
+		return fprintf(to, "unknown<%hhx %x %x %x>\n", i->kind, i->to, i->L, i->R);
 	}
 #undef  T
 }
@@ -134,6 +162,7 @@ static int fprint_ir3_node(FILE *to, const ir3_func *f, const ir3_node *node, pt
 {
 	int indent = 4;
 	int printed = fprintf(to, "L%tx: ", idx);
+	if (node->begin == node->end) printed += fprintf(to, "\n");
 	for (idx_t i = node->begin; i < node->end; i += sizeof(ssa_instr)) {
 		ssa_instr *instr = f->ins.buf.addr + i;
 		int extra = 0;
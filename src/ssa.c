@@ -0,0 +1,558 @@
+#include "ssa.h"
+#include "3ac.h"
+#include "ast.h"
+#include "alloc.h"
+#include "dynarr.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <stdbool.h>
+
+bool ssa_is_terminator(const ssa_instr *i)
+{
+	return i->kind == SSA_GOTO || i->kind == SSA_BR || i->kind == SSA_RET;
+}
+
+static ssa_instr *instr_at(const ir3_func *f, idx_t offset)
+{
+	return f->ins.buf.addr + offset;
+}
+
+static ssa_instr *next_instr(ssa_instr *i)
+{
+	return i + 1 + ssa_ext_len(i);
+}
+
+static ssa_ref intersect(const ir3_cfg *cfg, ssa_ref b1, ssa_ref b2)
+{
+	while (b1 != b2) {
+		while (cfg->order[b1] > cfg->order[b2]) b1 = cfg->idom[b1];
+		while (cfg->order[b2] > cfg->order[b1]) b2 = cfg->idom[b2];
+	}
+	return b1;
+}
+
+void cfg_init(ir3_cfg *cfg, const ir3_func *f, allocator *a)
+{
+	idx_t n = dyn_arr_size(&f->nodes) / sizeof(ir3_node);
+	const ir3_node *nodes = f->nodes.buf.addr;
+	static_assert(sizeof(idx_t) == sizeof(ssa_ref), "");
+	cfg->m = ALLOC(a, (11*n + 2) * sizeof(idx_t), alignof(idx_t));
+	idx_t *w = cfg->m.addr;
+	cfg->num_blocks = n;
+	cfg->ends = w; w += n;
+	cfg->succ = (void*) w; w += 2*n;
+	cfg->pred_begin = w; w += n+1;
+	cfg->preds = (ssa_ref*) w; w += 2*n;
+	cfg->rpo = (ssa_ref*) w; w += n;
+	cfg->order = w; w += n;
+	cfg->idom = (ssa_ref*) w; w += n;
+	cfg->child_begin = w; w += n+1;
+	cfg->children = (ssa_ref*) w; w += n;
+
+	for (idx_t b = 0; b < n; b++) {
+		ssa_instr *i = instr_at(f, nodes[b].begin), *end = instr_at(f, nodes[b].end);
+		while (i != end && !ssa_is_terminator(i))
+			i = next_instr(i);
+		cfg->succ[b][0] = cfg->succ[b][1] = REF_NONE;
+		if (i == end) {
+			if (b + 1 < n) cfg->succ[b][0] = b + 1;
+		} else {
+			if (i->kind == SSA_GOTO) {
+				cfg->succ[b][0] = i->to;
+			} else if (i->kind == SSA_BR) {
+				assert(i[1].L != i[1].R);
+				cfg->succ[b][0] = i[1].L;
+				cfg->succ[b][1] = i[1].R;
+			}
+			i = next_instr(i);
+		}
+		cfg->ends[b] = (void*) i - f->ins.buf.addr;
+	}
+
+	// iterative dfs from the entry, the postorder gets written from the back of `rpo`
+	allocation m = ALLOC(a, 2 * n * sizeof(idx_t), alignof(idx_t));
+	ssa_ref *stack = m.addr;
+	idx_t *next = (idx_t*) stack + n;
+	for (idx_t b = 0; b < n; b++)
+		cfg->order[b] = -1;
+	idx_t top = 0, post = n;
+	if (n) {
+		stack[top++] = 0;
+		next[0] = 0;
+		cfg->order[0] = -2;
+	}
+	while (top) {
+		ssa_ref b = stack[top-1];
+		if (next[b] < 2 && cfg->succ[b][next[b]] != REF_NONE) {
+			ssa_ref s = cfg->succ[b][next[b]++];
+			if (cfg->order[s] == -1) {
+				cfg->order[s] = -2;
+				next[s] = 0;
+				stack[top++] = s;
+			}
+		} else {
+			cfg->rpo[--post] = b;
+			top--;
+		}
+	}
+	DEALLOC(a, m);
+	cfg->num_reachable = n - post;
+	memmove(cfg->rpo, cfg->rpo + post, cfg->num_reachable * sizeof *cfg->rpo);
+	for (idx_t k = 0; k < cfg->num_reachable; k++)
+		cfg->order[cfg->rpo[k]] = k;
+
+	// predecessors, counted then placed
+	memset(cfg->pred_begin, 0, (n+1) * sizeof *cfg->pred_begin);
+	for (idx_t b = 0; b < n; b++) if (cfg->order[b] >= 0)
+		for (int k = 0; k < 2 && cfg->succ[b][k] != REF_NONE; k++)
+			cfg->pred_begin[cfg->succ[b][k] + 1]++;
+	for (idx_t b = 0; b < n; b++)
+		cfg->pred_begin[b+1] += cfg->pred_begin[b];
+	for (idx_t b = 0; b < n; b++) if (cfg->order[b] >= 0)
+		for (int k = 0; k < 2 && cfg->succ[b][k] != REF_NONE; k++) {
+			ssa_ref s = cfg->succ[b][k];
+			// the start of each block is its cursor, leaving it at the start of the next one
+			cfg->preds[cfg->pred_begin[s]++] = b;
+		}
+	for (idx_t b = n; b > 0; b--)
+		cfg->pred_begin[b] = cfg->pred_begin[b-1];
+	if (n) cfg->pred_begin[0] = 0;
+
+	// Cooper, Harvey & Kennedy: "A Simple, Fast Dominance Algorithm"
+	for (idx_t b = 0; b < n; b++)
+		cfg->idom[b] = REF_NONE;
+	if (n) cfg->idom[0] = 0;
+	for (bool changed = true; changed; ) {
+		changed = false;
+		for (idx_t k = 1; k < cfg->num_reachable; k++) {
+			ssa_ref b = cfg->rpo[k], dom = REF_NONE;
+			for (idx_t p = cfg->pred_begin[b]; p < cfg->pred_begin[b+1]; p++) {
+				ssa_ref pred = cfg->preds[p];
+				if (cfg->idom[pred] == REF_NONE) continue;
+				dom = dom == REF_NONE? pred: intersect(cfg, pred, dom);
+			}
+			if (cfg->idom[b] != dom) {
+				cfg->idom[b] = dom;
+				changed = true;
+			}
+		}
+	}
+
+	// the dominator tree, children in reverse postorder
+	memset(cfg->child_begin, 0, (n+1) * sizeof *cfg->child_begin);
+	for (idx_t k = 1; k < cfg->num_reachable; k++)
+		cfg->child_begin[cfg->idom[cfg->rpo[k]] + 1]++;
+	for (idx_t b = 0; b < n; b++)
+		cfg->child_begin[b+1] += cfg->child_begin[b];
+	for (idx_t k = 1; k < cfg->num_reachable; k++) {
+		ssa_ref b = cfg->rpo[k];
+		cfg->children[cfg->child_begin[cfg->idom[b]]++] = b;
+	}
+	for (idx_t b = n; b > 0; b--)
+		cfg->child_begin[b] = cfg->child_begin[b-1];
+	cfg->child_begin[0] = 0;
+}
+
+void cfg_fini(ir3_cfg *cfg, allocator *a)
+{
+	DEALLOC(a, cfg->m);
+}
+
+bool cfg_dominates(const ir3_cfg *cfg, ssa_ref dom, ssa_ref b)
+{
+	if (cfg->order[b] < 0) return false;
+	while (b != dom && b != 0)
+		b = cfg->idom[b];
+	return b == dom;
+}
+
+static ssa_ref fresh_local(ir3_func *f, ssa_ref like, allocator *a)
+{
+	type *t = ((type**) f->locals.buf.addr)[like];
+	ssa_ref num = dyn_arr_size(&f->locals) / sizeof t;
+	assert(num != REF_NONE);
+	dyn_arr_push(&f->locals, &t, sizeof t, a);
+	return num;
+}
+
+static bool promotable(const type *t)
+{
+	if (t->kind != TYPE_PTR && !(TYPE_PRIMITIVE_BEGIN <= t->kind && t->kind <= TYPE_PRIMITIVE_END))
+		return false;
+	return t->size == 1 || t->size == 2 || t->size == 4 || t->size == 8;
+}
+
+typedef struct ref_pair {
+	ssa_ref first, second;
+} ref_pair;
+
+static int ref_pair_cmp(const void *L, const void *R)
+{
+	const ref_pair *l = L, *r = R;
+	if (l->first != r->first) return (l->first > r->first) - (l->first < r->first);
+	return (l->second > r->second) - (l->second < r->second);
+}
+
+typedef struct phi_info {
+	ssa_ref var, dst;
+	idx_t next; // next phi of the same block, -1 at the end
+	idx_t args; // index of the first of the npreds values in `args`
+} phi_info;
+
+typedef struct var_info {
+	idx_t defs;
+	idx_t killed_in; // last block where it was defined while scanning
+	bool addressed, global, promoted;
+} var_info;
+
+typedef struct ssa_state {
+	ir3_func *f;
+	ir3_cfg *cfg;
+	var_info *vars;
+	idx_t num_vars;
+	ssa_ref *cur; // current name of each variable
+	dyn_arr undo; // ref_pair { var, previous name }
+	dyn_arr phis; // phi_info
+	dyn_arr args; // ssa_ref
+	idx_t *phi_head; // [b] = first phi of b, -1 if none
+	allocator *a;
+} ssa_state;
+
+static void rename_push(ssa_state *st, ssa_ref var, ssa_ref name)
+{
+	dyn_arr_push(&st->undo, &(ref_pair){ var, st->cur[var] }, sizeof(ref_pair), st->a);
+	st->cur[var] = name;
+}
+
+static idx_t pred_index(const ir3_cfg *cfg, ssa_ref b, ssa_ref pred)
+{
+	for (idx_t p = cfg->pred_begin[b]; p < cfg->pred_begin[b+1]; p++)
+		if (cfg->preds[p] == pred)
+			return p - cfg->pred_begin[b];
+	__builtin_unreachable();
+}
+
+static void rename_block(ssa_state *st, ssa_ref b)
+{
+	ir3_cfg *cfg = st->cfg;
+	idx_t mark = dyn_arr_size(&st->undo);
+	for (idx_t k = st->phi_head[b]; k != -1; ) {
+		ssa_ref name = fresh_local(st->f, ((phi_info*) st->phis.buf.addr)[k].var, st->a);
+		phi_info *phi = (phi_info*) st->phis.buf.addr + k;
+		phi->dst = name;
+		rename_push(st, phi->var, name);
+		k = phi->next;
+	}
+
+	const ir3_node *node = (ir3_node*) st->f->nodes.buf.addr + b;
+	for (ssa_instr *i = instr_at(st->f, node->begin), *end = instr_at(st->f, cfg->ends[b]); i != end; i = next_instr(i)) {
+		ssa_ref *use_end, *use = ssa_uses(i, &use_end);
+		for (; use != use_end; use++)
+			if (*use < (ssa_ref) st->num_vars && st->vars[*use].promoted)
+				*use = st->cur[*use];
+		ssa_ref def = ssa_def(i);
+		if (def != REF_NONE && st->vars[def].promoted) {
+			ssa_ref name = fresh_local(st->f, def, st->a);
+			i->to = name;
+			rename_push(st, def, name);
+		}
+	}
+
+	for (int s = 0; s < 2 && cfg->succ[b][s] != REF_NONE; s++) {
+		ssa_ref succ = cfg->succ[b][s];
+		idx_t j = pred_index(cfg, succ, b);
+		for (idx_t k = st->phi_head[succ]; k != -1; ) {
+			phi_info *phi = (phi_info*) st->phis.buf.addr + k;
+			((ssa_ref*) st->args.buf.addr)[phi->args + j] = st->cur[phi->var];
+			k = phi->next;
+		}
+	}
+
+	for (idx_t c = cfg->child_begin[b]; c < cfg->child_begin[b+1]; c++)
+		rename_block(st, cfg->children[c]);
+
+	for (ref_pair *u = st->undo.end; (idx_t) dyn_arr_size(&st->undo) != mark; ) {
+		u--;
+		st->cur[u->first] = u->second;
+		dyn_arr_pop(&st->undo, sizeof *u);
+	}
+}
+
+static void ssa_func(ir3_func *f, allocator *a)
+{
+	ir3_cfg cfg;
+	cfg_init(&cfg, f, a);
+	idx_t n = cfg.num_blocks;
+	if (!n) {
+		cfg_fini(&cfg, a);
+		return;
+	}
+	// the entry has nowhere to take the incoming values of a phi from
+	assert(cfg.pred_begin[0] == cfg.pred_begin[1]);
+	const ir3_node *nodes = f->nodes.buf.addr;
+	ssa_state st = { .f=f, .cfg=&cfg, .a=a };
+	st.num_vars = dyn_arr_size(&f->locals) / sizeof(type*);
+	allocation mv = ALLOC(a, st.num_vars * (sizeof(var_info) + sizeof(ssa_ref)), alignof(var_info));
+	st.vars = mv.addr;
+	st.cur = (ssa_ref*) (st.vars + st.num_vars);
+	for (idx_t v = 0; v < st.num_vars; v++) {
+		st.vars[v] = (var_info){ .killed_in=-1 };
+		st.cur[v] = v; // read before any definition, the value is undefined
+	}
+
+	// which variables are defined where, and used across blocks
+	dyn_arr defsites; dyn_arr_init(&defsites, 0, a); // ref_pair { var, block }
+	for (idx_t k = 0; k < cfg.num_reachable; k++) {
+		ssa_ref b = cfg.rpo[k];
+		for (ssa_instr *i = instr_at(f, nodes[b].begin), *end = instr_at(f, cfg.ends[b]); i != end; i = next_instr(i)) {
+			ssa_ref *use_end, *use = ssa_uses(i, &use_end);
+			for (; use != use_end; use++)
+				if (st.vars[*use].killed_in != (idx_t) b)
+					st.vars[*use].global = true;
+			if (i->kind == SSA_ADDRESS)
+				st.vars[i->L].addressed = true;
+			ssa_ref def = ssa_def(i);
+			if (def == REF_NONE) continue;
+			st.vars[def].defs++;
+			st.vars[def].killed_in = b;
+			dyn_arr_push(&defsites, &(ref_pair){ def, b }, sizeof(ref_pair), a);
+		}
+	}
+	type **ltypes = f->locals.buf.addr;
+	for (idx_t v = 0; v < st.num_vars; v++)
+		st.vars[v].promoted = st.vars[v].defs >= 2 && !st.vars[v].addressed && promotable(ltypes[v]);
+
+	// dominance frontiers, as (block, frontier) pairs
+	dyn_arr df; dyn_arr_init(&df, 0, a);
+	for (idx_t b = 0; b < n; b++) {
+		if (cfg.pred_begin[b+1] - cfg.pred_begin[b] < 2) continue;
+		for (idx_t p = cfg.pred_begin[b]; p < cfg.pred_begin[b+1]; p++)
+			for (ssa_ref runner = cfg.preds[p]; runner != cfg.idom[b]; runner = cfg.idom[runner])
+				dyn_arr_push(&df, &(ref_pair){ runner, b }, sizeof(ref_pair), a);
+	}
+	ref_pair *dfs = df.buf.addr;
+	idx_t num_df = dyn_arr_size(&df) / sizeof *dfs;
+	if (num_df) qsort(dfs, num_df, sizeof *dfs, ref_pair_cmp);
+
+	// per-block scratch: first frontier pair, phi list, iteration stamps
+	allocation mb = ALLOC(a, (4*n + 1) * sizeof(idx_t), alignof(idx_t));
+	idx_t *df_begin = mb.addr;
+	st.phi_head = df_begin + n+1;
+	idx_t *has_phi = st.phi_head + n, *work = has_phi + n;
+	for (idx_t b = 0, k = 0; b <= n; b++) {
+		while (k < num_df && (idx_t) dfs[k].first < b) k++;
+		df_begin[b] = k;
+	}
+	for (idx_t b = 0; b < n; b++) {
+		st.phi_head[b] = -1;
+		has_phi[b] = work[b] = -1;
+	}
+
+	// phis for the promoted variables which live across blocks
+	dyn_arr_init(&st.phis, 0, a);
+	dyn_arr_init(&st.args, 0, a);
+	dyn_arr worklist; dyn_arr_init(&worklist, 0, a);
+	ref_pair *sites = defsites.buf.addr;
+	idx_t num_sites = dyn_arr_size(&defsites) / sizeof *sites;
+	if (num_sites) qsort(sites, num_sites, sizeof *sites, ref_pair_cmp);
+	for (idx_t k = 0, next; k < num_sites; k = next) {
+		ssa_ref v = sites[k].first;
+		for (next = k; next < num_sites && sites[next].first == v; next++)
+			if (work[sites[next].second] != (idx_t) v) {
+				work[sites[next].second] = v;
+				dyn_arr_push(&worklist, &sites[next].second, sizeof(ssa_ref), a);
+			}
+		if (!st.vars[v].promoted || !st.vars[v].global) {
+			worklist.end = worklist.buf.addr;
+			continue;
+		}
+		while (!dyn_arr_empty(&worklist)) {
+			ssa_ref x = *(ssa_ref*) (worklist.end - sizeof x);
+			dyn_arr_pop(&worklist, sizeof x);
+			for (idx_t d = df_begin[x]; d < df_begin[x+1]; d++) {
+				ssa_ref y = dfs[d].second;
+				if (has_phi[y] == (idx_t) v) continue;
+				has_phi[y] = v;
+				idx_t npreds = cfg.pred_begin[y+1] - cfg.pred_begin[y];
+				phi_info phi = { .var=v, .dst=REF_NONE, .next=st.phi_head[y], .args=dyn_arr_size(&st.args) / sizeof(ssa_ref) };
+				st.phi_head[y] = dyn_arr_size(&st.phis) / sizeof phi;
+				dyn_arr_push(&st.phis, &phi, sizeof phi, a);
+				dyn_arr_push(&st.args, NULL, npreds * sizeof(ssa_ref), a);
+				if (work[y] != (idx_t) v) {
+					work[y] = v;
+					dyn_arr_push(&worklist, &y, sizeof y, a);
+				}
+			}
+		}
+	}
+	dyn_arr_fini(&worklist, a);
+	dyn_arr_fini(&defsites, a);
+	dyn_arr_fini(&df, a);
+
+	dyn_arr_init(&st.undo, 0, a);
+	rename_block(&st, 0);
+	dyn_arr_fini(&st.undo, a);
+
+	// rebuild the stream with the phis in front, dropping unreachable code
+	dyn_arr ins; dyn_arr_init(&ins, dyn_arr_size(&f->ins), a);
+	ir3_node *wnodes = f->nodes.buf.addr;
+	for (idx_t b = 0; b < n; b++) {
+		idx_t begin = dyn_arr_size(&ins);
+		if (cfg.order[b] >= 0) {
+			idx_t npreds = cfg.pred_begin[b+1] - cfg.pred_begin[b];
+			for (idx_t k = st.phi_head[b]; k != -1; ) {
+				phi_info *phi = (phi_info*) st.phis.buf.addr + k;
+				ssa_instr *out = dyn_arr_push(&ins, NULL, sizeof *out, a);
+				*out = (ssa_instr){ .kind=SSA_PHI, phi->dst, .R=npreds };
+				idx_t num_ext = ssa_ext_len(out);
+				ssa_instr *ext = dyn_arr_push(&ins, NULL, num_ext * sizeof *ext, a);
+				memset(ext, 0, num_ext * sizeof *ext);
+				ssa_ref *labels = (ssa_ref*) ext, *values = labels + npreds;
+				memcpy(labels, cfg.preds + cfg.pred_begin[b], npreds * sizeof *labels);
+				memcpy(values, (ssa_ref*) st.args.buf.addr + phi->args, npreds * sizeof *values);
+				k = phi->next;
+			}
+			dyn_arr_push(&ins, instr_at(f, wnodes[b].begin), cfg.ends[b] - wnodes[b].begin, a);
+		}
+		wnodes[b] = (ir3_node){ .begin=begin, .end=dyn_arr_size(&ins) };
+	}
+	dyn_arr_fini(&f->ins, a);
+	f->ins = ins;
+
+	dyn_arr_fini(&st.phis, a);
+	dyn_arr_fini(&st.args, a);
+	DEALLOC(a, mb);
+	DEALLOC(a, mv);
+	cfg_fini(&cfg, a);
+}
+
+void convert_to_ssa(ir3_module m, allocator *a)
+{
+	for (ir3_sym *s = scratch_start(m); s != scratch_end(m); s++)
+		if (s->kind == IR3_FUNC)
+			ssa_func(&s->f, a);
+}
+
+// `dst[k] = src[k]` all at once, the destinations being distinct
+static void emit_parallel_copy(dyn_arr *ins, ir3_func *f, ref_pair *copies, idx_t n, allocator *a)
+{
+	for (idx_t k = 0; k < n; )
+		if (copies[k].first == copies[k].second)
+			copies[k] = copies[--n];
+		else
+			k++;
+	while (n) {
+		// a destination that no other copy still has to read can be written right away
+		idx_t k;
+		for (k = 0; k < n; k++) {
+			idx_t l;
+			for (l = 0; l < n && copies[l].second != copies[k].first; l++)
+				;
+			if (l == n) break;
+		}
+		if (k == n) {
+			// only cycles left, keep the old value of one destination aside
+			k = 0;
+			ssa_ref tmp = fresh_local(f, copies[k].first, a);
+			dyn_arr_push(ins, &(ssa_instr){ .kind=SSA_COPY, tmp, copies[k].first }, sizeof(ssa_instr), a);
+			for (idx_t l = 0; l < n; l++)
+				if (copies[l].second == copies[k].first)
+					copies[l].second = tmp;
+		}
+		dyn_arr_push(ins, &(ssa_instr){ .kind=SSA_COPY, copies[k].first, copies[k].second }, sizeof(ssa_instr), a);
+		copies[k] = copies[--n];
+	}
+}
+
+typedef struct phi_edge {
+	ssa_ref pred, succ;
+	idx_t begin, end; // copies, as ref_pair { dst, src }
+} phi_edge;
+
+static void out_of_ssa_func(ir3_func *f, allocator *a)
+{
+	idx_t n = dyn_arr_size(&f->nodes) / sizeof(ir3_node);
+	dyn_arr edges; dyn_arr_init(&edges, 0, a);
+	dyn_arr copies; dyn_arr_init(&copies, 0, a);
+	// at most 2 outgoing edges per block, the phis being only on reachable blocks
+	allocation mo = ALLOC(a, 2 * n * sizeof(idx_t), alignof(idx_t));
+	idx_t (*out)[2] = mo.addr;
+	for (idx_t b = 0; b < n; b++)
+		out[b][0] = out[b][1] = -1;
+
+	const ir3_node *nodes = f->nodes.buf.addr;
+	for (idx_t b = 0; b < n; b++) {
+		ssa_instr *first = instr_at(f, nodes[b].begin), *end = instr_at(f, nodes[b].end);
+		if (first == end || first->kind != SSA_PHI) continue;
+		for (ssa_ref j = 0; j < first->R; j++) {
+			phi_edge e = { .pred=((ssa_ref*) &first[1])[j], .succ=b, .begin=dyn_arr_size(&copies) / sizeof(ref_pair) };
+			for (ssa_instr *i = first; i != end && i->kind == SSA_PHI; i = next_instr(i)) {
+				assert(i->R == first->R);
+				ssa_ref *labels = (ssa_ref*) &i[1], *values = labels + i->R;
+				assert(labels[j] == e.pred);
+				dyn_arr_push(&copies, &(ref_pair){ i->to, values[j] }, sizeof(ref_pair), a);
+			}
+			e.end = dyn_arr_size(&copies) / sizeof(ref_pair);
+			idx_t *slot = &out[e.pred][out[e.pred][0] != -1];
+			assert(*slot == -1);
+			*slot = dyn_arr_size(&edges) / sizeof e;
+			dyn_arr_push(&edges, &e, sizeof e, a);
+		}
+	}
+
+	dyn_arr ins; dyn_arr_init(&ins, dyn_arr_size(&f->ins), a);
+	dyn_arr splits; dyn_arr_init(&splits, 0, a); // idx_t, edges that get a block of their own
+	ir3_node *wnodes = f->nodes.buf.addr;
+	for (idx_t b = 0; b < n; b++) {
+		idx_t begin = dyn_arr_size(&ins);
+		ssa_instr *i = instr_at(f, wnodes[b].begin), *end = instr_at(f, wnodes[b].end);
+		for (; i != end && !ssa_is_terminator(i); i = next_instr(i))
+			if (i->kind != SSA_PHI)
+				dyn_arr_push(&ins, i, (1 + ssa_ext_len(i)) * sizeof *i, a);
+		phi_edge *e = edges.buf.addr;
+		if (i != end && i->kind == SSA_BR) {
+			// critical, as a block with phis has several predecessors
+			ssa_instr br[2] = { i[0], i[1] };
+			for (int k = 0; k < 2 && out[b][k] != -1; k++) {
+				ssa_ref label = n + dyn_arr_size(&splits) / sizeof(idx_t);
+				if (br[1].L == e[out[b][k]].succ) br[1].L = label;
+				if (br[1].R == e[out[b][k]].succ) br[1].R = label;
+				dyn_arr_push(&splits, &out[b][k], sizeof(idx_t), a);
+			}
+			dyn_arr_push(&ins, br, sizeof br, a);
+		} else {
+			// goto, ret or fallthrough: the only successor, if any
+			assert(out[b][1] == -1);
+			if (out[b][0] != -1) {
+				phi_edge *edge = &e[out[b][0]];
+				emit_parallel_copy(&ins, f, (ref_pair*) copies.buf.addr + edge->begin, edge->end - edge->begin, a);
+			}
+			if (i != end)
+				dyn_arr_push(&ins, i, sizeof *i, a);
+		}
+		wnodes[b] = (ir3_node){ .begin=begin, .end=dyn_arr_size(&ins) };
+	}
+	for (idx_t *s = splits.buf.addr; s != splits.end; s++) {
+		phi_edge *edge = (phi_edge*) edges.buf.addr + *s;
+		idx_t begin = dyn_arr_size(&ins);
+		emit_parallel_copy(&ins, f, (ref_pair*) copies.buf.addr + edge->begin, edge->end - edge->begin, a);
+		dyn_arr_push(&ins, &(ssa_instr){ .kind=SSA_GOTO, edge->succ }, sizeof(ssa_instr), a);
+		dyn_arr_push(&f->nodes, &(ir3_node){ .begin=begin, .end=dyn_arr_size(&ins) }, sizeof(ir3_node), a);
+	}
+	dyn_arr_fini(&f->ins, a);
+	f->ins = ins;
+
+	dyn_arr_fini(&splits, a);
+	DEALLOC(a, mo);
+	dyn_arr_fini(&copies, a);
+	dyn_arr_fini(&edges, a);
+}
+
+void convert_from_ssa(ir3_module m, allocator *a)
+{
+	for (ir3_sym *s = scratch_start(m); s != scratch_end(m); s++)
+		if (s->kind == IR3_FUNC)
+			out_of_ssa_func(&s->f, a);
+}
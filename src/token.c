@@ -3,17 +3,22 @@
 #include "print.h"
 #include "file.h"
 #include "alloc.h"
+#include "attrs.h"
 
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <ctype.h>
 #include <assert.h>
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
 
 #define IDENT_MAX_LEN 32
 
 
 struct global_token_state tokens;
+_Thread_local struct token_cursor lexer;
 
 // assuming 0-init for the fields not mentioned
 static const enum {
@@ -42,8 +47,143 @@ static const enum {
 
 static bool isident(char c) { return isdigit(c) || isalpha(c) || c == '_'; }
 
+// each one returns the first byte from `at` on that's not in its class. the source is followed by
+// 0x1000 bytes of sentinel, so reading a whole vector past the last byte of the source is fine
+static struct token_scans {
+	const char *(*ident)(const char *at);
+	const char *(*space)(const char *at);
+	const char *(*comment)(const char *at); // stops on the '\n', or on the sentinel
+	// counts the newlines in the first `len` bytes, and writes where the lines after them start if `marks` is given
+	size_t (*newlines)(source_idx len, source_idx *marks);
+} scan;
+
+static const char *scan_ident(const char *at)   { while (isident(*at)) at++; return at; }
+static const char *scan_space(const char *at)   { while (isspace(*at)) at++; return at; }
+static const char *scan_comment(const char *at) { while (*at != '\n' && *at) at++; return at; }
+
+static size_t newlines(source_idx len, source_idx *marks)
+{
+	size_t cnt = 0;
+	for (source_idx i = 0; i < len; i++)
+		if (tokens.base[i] == '\n') {
+			if (marks) marks[cnt] = i+1;
+			cnt++;
+		}
+	return cnt;
+}
+
+#ifdef __x86_64__
+// signed compares: the bytes >= 0x80 are below everything, and never in a class
+static __m128i ident_sse2(__m128i v)
+{
+	__m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+	__m128i digit = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0'-1)), _mm_cmpgt_epi8(_mm_set1_epi8('9'+1), v));
+	__m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a'-1)), _mm_cmpgt_epi8(_mm_set1_epi8('z'+1), lower));
+	return _mm_or_si128(_mm_or_si128(digit, alpha), _mm_cmpeq_epi8(v, _mm_set1_epi8('_')));
+}
+
+static __m128i space_sse2(__m128i v)
+{
+	__m128i ctrl = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('\t'-1)), _mm_cmpgt_epi8(_mm_set1_epi8('\r'+1), v));
+	return _mm_or_si128(ctrl, _mm_cmpeq_epi8(v, _mm_set1_epi8(' ')));
+}
+
+static __m128i comment_sse2(__m128i v)
+{
+	return _mm_andnot_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')), _mm_cmpeq_epi8(v, _mm_setzero_si128())), _mm_set1_epi8(-1));
+}
+
+#define SCAN_SSE2(CLASS) \
+static const char *scan_##CLASS##_sse2(const char *at) \
+{ \
+	for (;; at += 16) { \
+		unsigned out = ~_mm_movemask_epi8(CLASS##_sse2(_mm_loadu_si128((const __m128i*) at))) & 0xffff; \
+		if (out) return at + __builtin_ctz(out); \
+	} \
+}
+SCAN_SSE2(ident)
+SCAN_SSE2(space)
+SCAN_SSE2(comment)
+#undef SCAN_SSE2
+
+// the last vector reads a bit of the sentinel, which has no newline
+static size_t newlines_sse2(source_idx len, source_idx *marks)
+{
+	size_t cnt = 0;
+	for (source_idx i = 0; i < len; i += 16) {
+		unsigned nl = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) &tokens.base[i]), _mm_set1_epi8('\n')));
+		if (!marks) cnt += __builtin_popcount(nl);
+		else for (; nl; nl &= nl-1) marks[cnt++] = i + __builtin_ctz(nl) + 1;
+	}
+	return cnt;
+}
+
+#define AVX2 __attribute__((target("avx2,popcnt")))
+static AVX2 __m256i ident_avx2(__m256i v)
+{
+	__m256i lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+	__m256i digit = _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('0'-1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('9'+1), v));
+	__m256i alpha = _mm256_and_si256(_mm256_cmpgt_epi8(lower, _mm256_set1_epi8('a'-1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('z'+1), lower));
+	return _mm256_or_si256(_mm256_or_si256(digit, alpha), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('_')));
+}
+
+static AVX2 __m256i space_avx2(__m256i v)
+{
+	__m256i ctrl = _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('\t'-1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('\r'+1), v));
+	return _mm256_or_si256(ctrl, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')));
+}
+
+static AVX2 __m256i comment_avx2(__m256i v)
+{
+	return _mm256_andnot_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')), _mm256_cmpeq_epi8(v, _mm256_setzero_si256())), _mm256_set1_epi8(-1));
+}
+
+#define SCAN_AVX2(CLASS) \
+static AVX2 const char *scan_##CLASS##_avx2(const char *at) \
+{ \
+	for (;; at += 32) { \
+		unsigned out = ~(unsigned) _mm256_movemask_epi8(CLASS##_avx2(_mm256_loadu_si256((const __m256i*) at))); \
+		if (out) return at + __builtin_ctz(out); \
+	} \
+}
+SCAN_AVX2(ident)
+SCAN_AVX2(space)
+SCAN_AVX2(comment)
+#undef SCAN_AVX2
+
+static AVX2 size_t newlines_avx2(source_idx len, source_idx *marks)
+{
+	size_t cnt = 0;
+	for (source_idx i = 0; i < len; i += 32) {
+		unsigned nl = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*) &tokens.base[i]), _mm256_set1_epi8('\n')));
+		if (!marks) cnt += __builtin_popcount(nl);
+		else for (; nl; nl &= nl-1) marks[cnt++] = i + __builtin_ctz(nl) + 1;
+	}
+	return cnt;
+}
+#undef AVX2
+#endif
+
+static void pick_scans(void)
+{
+	scan = (struct token_scans){ scan_ident, scan_space, scan_comment, newlines };
+#ifdef __x86_64__
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt"))
+		scan = (struct token_scans){ scan_ident_avx2, scan_space_avx2, scan_comment_avx2, newlines_avx2 };
+	else
+		scan = (struct token_scans){ scan_ident_sse2, scan_space_sse2, scan_comment_sse2, newlines_sse2 };
+#endif
+}
+
+static void intern_init(void);
+static ident_t intern(const char *src, size_t len);
 static ident_t intern_string(source_idx start, size_t len);
-static bool ident_in_range(ident_t chk, const void *L, const void *R);
+
+// perfect on FORALL_KEYWORDS, checked when the table is filled. the lexer recognizes the keywords
+// straight from the source, the names that miss are never keywords and only then go through the idents
+#define KW_HASH(len, first, last) (((len) + (first) + ((last) << 3)) & 31)
+static struct { ident_t ident; size_t len; } kw_slots[32];
 
 int token_init(const char *path, allocator *up, allocator *names)
 {
@@ -52,38 +192,40 @@ int token_init(const char *path, allocator *up, allocator *names)
 	if (!e) {
 		tokens.len = (source_idx) len;
 		tokens.cpath = path;
-		for (source_idx i=0; i<tokens.len - 0x1000; i++)
-			if (tokens.base[i] == '\0') return -1;
-		tokens.lookahead.pos = 0;
-		tokens.lookahead.end = 0;
+		if (memchr(tokens.base, '\0', tokens.len - 0x1000)) return -1;
+		pick_scans();
 		tokens.names = names;
 		tokens.up = up;
-		map_init(&tokens.idents, 2, up);
-		dyn_arr_init(&tokens.line_marks, 2*sizeof(source_idx), up);
-		source_idx first_line = 0;
-		dyn_arr_push(&tokens.line_marks, &first_line, sizeof first_line, up);
-		#define KW(kw) do {\
-			map_entry *e = map_add(&tokens.idents, (key_t) #kw, string_hash, tokens.up); \
-			allocation m = ALLOC(tokens.names, sizeof(#kw), 1); \
-			memcpy(m.addr, #kw, sizeof(#kw)); \
-			tokens.kw_##kw = e->k = (key_t) m.addr; \
-			e->v = sizeof(#kw)-1; \
+		intern_init();
+		tokens.line_marks = (dyn_arr){ 0 };
+		tokens.line_marks_once = (once_flag) ONCE_FLAG_INIT;
+		memset(kw_slots, 0, sizeof kw_slots);
+		#define KW(kw) do { \
+			tokens.kw_##kw = intern(#kw, sizeof(#kw)-1); \
+			size_t h = KW_HASH(sizeof(#kw)-1, #kw[0], #kw[sizeof(#kw)-2]); \
+			assert(!kw_slots[h].len); \
+			kw_slots[h].ident = tokens.kw_##kw; \
+			kw_slots[h].len = sizeof(#kw)-1; \
 			} while (0);
 		FORALL_KEYWORDS
 		#undef KW
-
-		// arena grows down
-		tokens.keywords_begin = ident_str(tokens.kw_return);
-		tokens.keywords_end   = ident_str(tokens.kw_func);
-		token_advance();
-		token_advance();
+		token_seek(0, tokens.len);
 	}
 	return e;
 }
 
+void token_seek(source_idx begin, source_idx end)
+{
+	lexer.lookahead = (token){ .pos=begin, .end=begin };
+	lexer.limit = end;
+	token_advance();
+	token_advance();
+}
+
 void token_fini(void)
 {
-	dyn_arr_fini(&tokens.line_marks, tokens.up);
+	if (tokens.line_marks.buf.addr) dyn_arr_fini(&tokens.line_marks, tokens.up);
+	DEALLOC(tokens.up, tokens.idents.slots);
 	// names persist
 	int e = unmap_file_sentinel(tokens.base, tokens.len);
 	assert(e == 0);
@@ -91,18 +233,18 @@ void token_fini(void)
 
 bool token_done(void)
 {
-	return tokens.current.kind == TOKEN_END;
+	return lexer.current.kind == TOKEN_END;
 }
 
 void token_advance(void)
 {
-	tokens.current = tokens.lookahead;
-	const char *at = &tokens.base[tokens.lookahead.end];
+	lexer.current = lexer.lookahead;
+	const char *at = &tokens.base[lexer.lookahead.end];
 	token next;
 again:
 	next.pos = at - tokens.base;
 	const char *start = at;
-	switch ((next.kind = *at++)) {
+	switch ((next.kind = next.pos < lexer.limit? *at++: TOKEN_END)) {
 	case '\0': // sentinel
 	#define CASE2(FIRST, SECOND, FALLBACK) \
 	case FIRST: \
@@ -121,14 +263,17 @@ again:
 		break;
 	case 'A' ... 'Z': case 'a' ... 'z': case '_':
 		next.kind = TOKEN_NAME;
-		while (isident(*at)) at++;
+		at = scan.ident(at);
 		if (at-start > IDENT_MAX_LEN) {
 			next.kind = TOKEN_ERR_LONG_NAME;
 			break;
 		}
-		next.processed = intern_string(next.pos, at - start);
-		if (ident_in_range(next.processed, tokens.keywords_begin, tokens.keywords_end))
+		size_t h = KW_HASH(at - start, start[0], at[-1]);
+		if (kw_slots[h].len == (size_t)(at - start) && !memcmp(ident_str(kw_slots[h].ident), start, at - start)) {
 			next.kind = TOKEN_KEYWORD;
+			next.processed = kw_slots[h].ident;
+		} else
+			next.processed = intern_string(next.pos, at - start);
 		break;
 	case '0' ... '9':
 		next.kind = TOKEN_INT;
@@ -138,28 +283,21 @@ again:
 		break;
 	case '/':
 		assert(*at++ == '/');
-		while (*at != '\n') at++;
+		at = scan.comment(at);
 		/* fallthrough */
 	case '\n': case ' ': case '\t': case '\v': case '\r': case '\f':
-		{
-		source_idx line;
-		while (isspace(*at))
-			if (*at++ == '\n') {
-				line = at - tokens.base;
-				dyn_arr_push(&tokens.line_marks, &line, sizeof line, tokens.up);
-			}
-		}
+		at = scan.space(at);
 		goto again;
 	default:
 		next.kind = TOKEN_ERR_BEGIN;
 	}
 	next.end = at - tokens.base;
-	tokens.lookahead = next;
+	lexer.lookahead = next;
 }
 
 bool token_is(token_kind k)
 {
-	return tokens.current.kind == k;
+	return lexer.current.kind == k;
 }
 
 bool token_match(token_kind k)
@@ -178,14 +316,14 @@ const char *token_at(void)
 
 bool token_expect(token_kind k)
 {
-	bool r = expect_or(token_match(k), token_pos(), "error, expected token ", k, ", got ", tokens.current, " instead.\n");
+	bool r = expect_or(token_match(k), token_pos(), "error, expected token ", k, ", got ", lexer.current, " instead.\n");
 	if (!r) token_skip_to_newline();
 	return r;
 }
 
 bool lookahead_is(token_kind k)
 {
-	return tokens.lookahead.kind == k;
+	return lexer.lookahead.kind == k;
 }
 
 void test_token(void)
@@ -197,14 +335,13 @@ void test_token(void)
 	int e = token_init("cr/basic.cr", gpa, &names.base);
 	assert(e == 0);
 	do {
-		print(stdout, "\t", tokens.current, "\n");
-		if (TOKEN_ERR_BEGIN <= tokens.current.kind && tokens.current.kind <= TOKEN_ERR_END) {
-			print(stderr, tokens.current.pos, "error, unknown token ", tokens.current, ".\n");
+		print(stdout, "\t", lexer.current, "\n");
+		if (TOKEN_ERR_BEGIN <= lexer.current.kind && lexer.current.kind <= TOKEN_ERR_END) {
+			print(stderr, lexer.current.pos, "error, unknown token ", lexer.current, ".\n");
 		}
 		token_advance();
 	} while (!token_done());
 	token_fini();
-	map_fini(&tokens.idents, gpa);
 	allocator_geom_fini(&names);
 }
 
@@ -239,25 +376,60 @@ static key_t _string_cmp(key_t L, key_t R)
 	return 1;
 }
 
-ident_t intern_string(source_idx start, size_t len)
+// every occurrence of a name in the source is followed by at least 1 other byte, and copies the name
+// at most once (only if it wasn't there yet), so the length of the source bounds both the table and the arena
+void intern_init(void)
+{
+	size_t most = tokens.len/2 + 1;
+	#define KW(kw) + 1
+	most += 0 FORALL_KEYWORDS;
+	#undef KW
+	tokens.idents.slots = ALLOC(tokens.up, 2*most * sizeof(_Atomic uint32_t), alignof(_Atomic uint32_t));
+	memset(tokens.idents.slots.addr, 0, tokens.idents.slots.size);
+	#define KW(kw) + sizeof(#kw)
+	tokens.idents.arena = ALLOC(tokens.names, tokens.len + 1 FORALL_KEYWORDS, 1);
+	#undef KW
+	atomic_init(&tokens.idents.used, 0);
+}
+
+static uint32_t intern_append(const char *src, size_t len)
 {
-	bool inserted;
-	key_t k = (key_t) token_source(start);
-	map_entry *r = map_id(&tokens.idents, k, string_hash, _string_cmp, &inserted, tokens.up);
-	assert(r);
-	if (inserted) {
-		allocation m = ALLOC(tokens.names, len+1, 1);
-		memcpy(m.addr, token_source(start), len);
-		memcpy(m.addr + len, &(char){ '\0' }, 1); // need the NUL for that dirty ident_len function anyways
-		r->k = (key_t) m.addr; // guess I should have spent the time adding attributes to all functions
-		r->v = len;
+	size_t at = atomic_fetch_add_explicit(&tokens.idents.used, len+1, memory_order_relaxed);
+	assert(at + len+1 <= tokens.idents.arena.size);
+	char *name = tokens.idents.arena.addr + at;
+	memcpy(name, src, len);
+	name[len] = '\0'; // need the NUL for that dirty ident_len function anyways
+	return at+1;
+}
+
+ident_t intern(const char *src, size_t len)
+{
+	_Atomic uint32_t *slots = tokens.idents.slots.addr;
+	size_t cap = tokens.idents.slots.size / sizeof *slots;
+	const char *names = tokens.idents.arena.addr;
+	uint32_t mine = 0;
+	for (size_t i = string_hash((key_t) src) % cap;; i = (i+1) % cap) {
+		uint32_t seen = atomic_load_explicit(&slots[i], memory_order_acquire);
+		if (!seen) {
+			// the copy is done before the slot is claimed, so nobody ever sees half a name
+			if (!mine) mine = intern_append(src, len);
+			if (atomic_compare_exchange_strong_explicit(&slots[i], &seen, mine, memory_order_acq_rel, memory_order_acquire))
+				return (ident_t) &names[mine-1];
+			// another thread got the slot first, `seen` is its name. if it's the same, the copy is just dead space
+		}
+		if (_string_cmp((key_t) &names[seen-1], (key_t) src) == 0)
+			return (ident_t) &names[seen-1];
 	}
-	return r->k;
+}
+
+ident_t intern_string(source_idx start, size_t len)
+{
+	return intern(token_source(start), len);
 }
 
 bool token_is_kw(ident_t kw)
 {
-	return tokens.current.kind == TOKEN_KEYWORD && tokens.current.processed == kw;
+	return lexer.current.kind == TOKEN_KEYWORD && lexer.current.processed == kw;
 }
 
 bool token_match_kw(ident_t kw)
@@ -271,32 +443,45 @@ bool token_match_kw(ident_t kw)
 
 bool token_expect_kw(ident_t kw)
 {
-	bool r = expect_or(token_match_kw(kw), token_pos(), "error, expected keyword ", kw, ", got token ", tokens.current, " instead.\n");
+	bool r = expect_or(token_match_kw(kw), token_pos(), "error, expected keyword ", kw, ", got token ", lexer.current, " instead.\n");
 	if (!r) token_skip_to_newline();
 	return r;
 }
 
 bool lookahead_is_kw(ident_t kw)
 {
-	return tokens.lookahead.kind == TOKEN_KEYWORD && tokens.lookahead.processed == kw;
+	return lexer.lookahead.kind == TOKEN_KEYWORD && lexer.lookahead.processed == kw;
 }
 
 bool token_match_precedence(token_kind p)
 {
 	assert(0 <= p && p < sizeof token_precedence/sizeof *token_precedence);
-	bool r = token_precedence[tokens.current.kind] & token_precedence[p];
+	bool r = token_precedence[lexer.current.kind] & token_precedence[p];
 	if (r) token_advance();
 	return r;
 }
 
 void token_unexpected(void)
 {
-	if (!expect_or(false, token_pos(), "unexpected token ", tokens.current, "\n"))
+	if (!expect_or(false, token_pos(), "unexpected token ", lexer.current, "\n"))
 		token_skip_to_newline();
 }
 
+// once for the whole file, whichever thread gets the first diagnostic
+static void build_line_marks(void)
+{
+	source_idx len = tokens.len - 0x1000;
+	size_t cnt = 1 + scan.newlines(len, NULL);
+	dyn_arr_init(&tokens.line_marks, cnt * sizeof(source_idx), tokens.up);
+	source_idx *marks = dyn_arr_push(&tokens.line_marks, NULL, cnt * sizeof *marks, tokens.up);
+	marks[0] = 0;
+	MAYBE_UNUSED size_t check = scan.newlines(len, marks+1);
+	assert(check == cnt-1);
+}
+
 source_idx find_line(source_idx offset)
 {
+	call_once(&tokens.line_marks_once, build_line_marks);
 	source_idx *arr   = tokens.line_marks.buf.addr;
 	source_idx L = 0, R = (source_idx*) tokens.line_marks.end - arr;
 	if (offset >= arr[R-1]) return R-1;
@@ -313,19 +498,18 @@ void token_skip_to_newline(void)
 {
 	const char *at = token_at();
 	do { at++; } while (*at != '\n');
-	tokens.lookahead.end = at - tokens.base;
+	lexer.lookahead.end = at - tokens.base;
 	token_advance();
 	token_advance();
 }
 
-size_t ident_len(ident_t i) { return map_find(&tokens.idents, i, string_hash(i), _string_cmp)->v; }
+size_t ident_len(ident_t i) { return strlen(ident_str(i)); }
 const char *ident_str(ident_t i) { return (char*) i; }
-bool ident_in_range(ident_t chk, const void *L, const void *R) { return L <= (void*) ident_str(chk) && (void*) ident_str(chk) <= R; }
 bool ident_equals(ident_t L, ident_t R) { return L == R; }
 
 source_idx token_pos(void)
 {
-	return tokens.current.pos;
+	return lexer.current.pos;
 }
 
 const char *token_source(source_idx pos)
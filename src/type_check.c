@@ -1,13 +1,20 @@
+#define _POSIX_C_SOURCE 200809L // open_memstream
 #include "type_check.h"
 #include "print.h"
 #include "attrs.h"
+#include "pool.h"
 
 #include <stdbool.h>
 #include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 
 static struct type_checker_state {
 	allocator *temps;
+	allocation arenas; // allocator_geom[], where the bodies checked on each thread put their new nodes
+	int num_arenas;
 } types;
 
 typedef struct scope_iter {
@@ -104,14 +111,19 @@ case TYPE_FUNC:
 	break;
 
 case TYPE_STRUCT:
+	// done once its alignment is known, so that the bodies checked in parallel don't touch it
+	if (t->align) break;
 	t->kind = TYPE_NONE;
+	uint32_t align = 1;
 	for (map_entry *e = t->fields.m.addr, *end = t->fields.m.addr + t->fields.m.size;
 			e != end; e++) {
 		if (!e->k) continue;
 		decl *field = (decl*) e->v;
 		complete_type(field->type, stk, up);
+		if (field->type->align > align) align = field->type->align;
 	}
 	t->kind = TYPE_STRUCT;
+	t->align = align;
 	break;
 
 case TYPE_NONE:
@@ -441,20 +453,102 @@ void type_check_decl(decl_idx i, scope_iter *stk, allocator *up)
 	}
 }
 
-void type_check(module_t module, scope *global, allocator *up)
+// the diagnostics of each decl are kept apart while it is checked,
+// and written out in the order of the module once they all are
+typedef struct decl_diag {
+	char *buf[2]; // [0] while completing its type, [1] while checking its body
+	size_t len[2];
+	scope *sub; // the scope of the body, for the functions
+} decl_diag;
+
+typedef struct body_job {
+	decl_idx *decls;
+	decl_diag *diags;
+	scope *global;
+	allocator_geom *arenas;
+} body_job;
+
+static FILE *diag_open(decl_diag *dd, int phase)
 {
-	decl_idx *decl_it = scratch_start(module)  , *decl_end = scratch_end(module);
+	// straight to stderr if it can't be buffered, out of order is still better than nothing
+	return diag_redirect(open_memstream(&dd->buf[phase], &dd->len[phase]));
+}
+
+static void diag_close(FILE *prev)
+{
+	FILE *f = diag_redirect(prev);
+	if (f) fclose(f);
+}
+
+static void type_check_body(void *ctx, size_t i, int worker)
+{
+	body_job *job = ctx;
+	decl *d = idx2decl(job->decls[i]);
+	if (d->kind != DECL_FUNC) return;
+	decl_diag *dd = &job->diags[i];
+	FILE *prev = diag_open(dd, 1);
+	scope_iter bottom = { .scope=job->global, .sub=dd->sub, .next=NULL };
+	type_check_stmt_block(d->body, d->type->base, &bottom, &job->arenas[worker].base);
+	diag_close(prev);
+}
+
+// the types of every decl, and so every signature and struct, are completed first;
+// the function bodies then only read those and are checked on `jobs` threads
+void type_check(module_t module, scope *global, int jobs, allocator *up)
+{
+	decl_idx *decls = scratch_start(module);
+	idx_t num_decls = scratch_len(module) / sizeof(decl_idx);
+	allocation m = ALLOC(types.temps, (num_decls ? num_decls : 1) * sizeof(decl_diag), alignof(decl_diag));
+	decl_diag *diags = m.addr;
 	scope_iter bottom = { .scope=global, .sub=scratch_start(global->sub), .next=NULL };
-	for (; decl_it != decl_end; decl_it++)
-		type_check_decl(*decl_it, &bottom, up);
+	for (idx_t i = 0; i < num_decls; i++) {
+		diags[i] = (decl_diag){ 0 };
+		FILE *prev = diag_open(&diags[i], 0);
+		decl *d = idx2decl(decls[i]);
+		if (d->kind == DECL_FUNC) {
+			complete_type(d->type, &bottom, up);
+			// as type_check_stmt_block would
+			diags[i].sub = bottom.sub++;
+		} else
+			type_check_decl(decls[i], &bottom, up);
+		diag_close(prev);
+	}
+
+	jobs = parallel_jobs(num_decls, jobs);
+	allocation a = ALLOC(types.temps, jobs * sizeof(allocator_geom), alignof(allocator_geom));
+	allocator_geom *arenas = a.addr;
+	for (int w = 0; w < jobs; w++)
+		allocator_geom_init(&arenas[w], 10, 8, 0x100, types.temps);
+	body_job job = { decls, diags, global, arenas };
+	parallel_for(num_decls, jobs, type_check_body, &job);
+	// kept until type_fini, the AST points into them
+	allocation all = REALLOC(types.temps, types.arenas, (types.num_arenas + jobs) * sizeof(allocator_geom), alignof(allocator_geom));
+	memcpy((allocator_geom*) all.addr + types.num_arenas, arenas, jobs * sizeof(allocator_geom));
+	types.arenas = all;
+	types.num_arenas += jobs;
+	DEALLOC(types.temps, a);
+
+	for (idx_t i = 0; i < num_decls; i++) {
+		for (int phase = 0; phase < 2; phase++) {
+			if (diags[i].len[phase]) fwrite(diags[i].buf[phase], 1, diags[i].len[phase], diag_stream());
+			free(diags[i].buf[phase]);
+		}
+	}
+	DEALLOC(types.temps, m);
 	ast_dump(module);
 }
 
 void type_init(allocator *temps)
 {
 	types.temps = temps;
+	types.arenas = ALLOC_FAILURE;
+	types.num_arenas = 0;
 }
 
+// the nodes inserted by the checker live until then
 void type_fini(void)
 {
+	for (allocator_geom *g = types.arenas.addr, *end = g + types.num_arenas; g != end; g++)
+		allocator_geom_fini(g);
+	if (types.arenas.addr) DEALLOC(types.temps, types.arenas);
 }